@@ -0,0 +1,96 @@
+#define _GNU_SOURCE
+#include "uthread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// Context-switch benchmark: NUM_THREADS uthreads yield round-robin, so
+// every switch lands on a different stack and descriptor.
+// Usage: bench_switch [--arena]
+
+#define NUM_THREADS 10000
+#define ROUNDS 20
+
+static int tids[NUM_THREADS];
+
+void spinner(void *arg) {
+    (void)arg;
+    for (int i = 0; i < ROUNDS; i++) {
+        scheduler_yield();
+    }
+}
+
+// dTLB load misses of this process in user mode, or -1 if unavailable
+static int dtlb_counter_open(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[]) {
+    int use_arena = argc > 1 && strcmp(argv[1], "--arena") == 0;
+
+    if (use_arena && uthread_arena_init(NUM_THREADS) != 0) {
+        perror("uthread_arena_init");
+        return 1;
+    }
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        tids[i] = uthread_create(spinner, NULL);
+        if (tids[i] < 0) {
+            printf("Failed to create thread %d\n", i);
+            return 1;
+        }
+    }
+
+    int fd = dtlb_counter_open();
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    double start = now_ns();
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        uthread_join(tids[i], NULL);
+    }
+
+    double elapsed = now_ns() - start;
+    uint64_t misses = 0;
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &misses, sizeof(misses)) != sizeof(misses)) {
+            fd = -1;
+        }
+    }
+
+    double switches = (double)NUM_THREADS * ROUNDS;
+    printf("%-12s %d threads, %.0f switches, %.1f ns/switch",
+           use_arena ? (uthread_arena_hugetlb() ? "arena/hugetlb" : "arena/thp") : "mapped",
+           NUM_THREADS, switches, elapsed / switches);
+    if (fd >= 0) {
+        printf(", %.2f dTLB misses/switch\n", misses / switches);
+    } else {
+        printf(", dTLB misses n/a\n");
+    }
+    return 0;
+}
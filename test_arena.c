@@ -0,0 +1,96 @@
+#define _POSIX_C_SOURCE 200809L
+#include "uthread.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define ARENA_SLOTS 8
+#define NUM_THREADS 12          // Some slots beyond the arena
+#define ROUNDS 2
+#define BUF_BYTES 2048
+
+static int corrupted = 0;
+static int stale = 0;
+
+// A key reusing a deleted key's index starts out NULL on an arena thread too
+void tls_user(void *arg) {
+    (void)arg;
+    uthread_key_t key;
+    uthread_key_create(&key, NULL);
+    uthread_setspecific(key, &stale);
+    uthread_key_delete(key);
+
+    uthread_key_t reused;
+    uthread_key_create(&reused, NULL);
+    if (reused != key || uthread_getspecific(reused) != NULL) {
+        stale++;
+    }
+    uthread_key_delete(reused);
+}
+
+void worker(void *arg) {
+    int id = *(int *)arg;
+    volatile char buf[BUF_BYTES];
+    memset((char *)buf, id, sizeof(buf));
+
+    // Long enough to be preempted with the buffer live on the stack
+    for (volatile int j = 0; j < 2000000; j++);
+    scheduler_yield();
+
+    for (int i = 0; i < BUF_BYTES; i++) {
+        if (buf[i] != (char)id) {
+            corrupted++;
+            break;
+        }
+    }
+}
+
+int main() {
+    printf("=== Stack Arena Test ===\n");
+    int ok = 1;
+
+    ok = ok && uthread_arena_init(0) == -1 && errno == EINVAL;
+    if (uthread_arena_init(ARENA_SLOTS) != 0) {
+        printf("Arena setup failed\n");
+        return 1;
+    }
+    // The arena is fixed once set up
+    ok = ok && uthread_arena_init(ARENA_SLOTS) == -1 && errno == EBUSY;
+    printf("Arena backed by %s\n",
+           uthread_arena_hugetlb() ? "MAP_HUGETLB" : "transparent huge pages");
+
+    // Exited threads hand their slot stacks to the next round
+    int args[NUM_THREADS];
+    for (int round = 0; round < ROUNDS; round++) {
+        int tids[NUM_THREADS];
+        for (int i = 0; i < NUM_THREADS; i++) {
+            args[i] = round * NUM_THREADS + i + 1;
+            tids[i] = uthread_create(worker, &args[i]);
+            if (tids[i] < 0) {
+                printf("Failed to create thread %d\n", i);
+                return 1;
+            }
+        }
+        for (int i = 0; i < NUM_THREADS; i++) {
+            uthread_join(tids[i], NULL);
+        }
+    }
+    ok = ok && uthread_arena_init(ARENA_SLOTS) == -1 && errno == EBUSY;
+
+    int tls_tid = uthread_create(tls_user, NULL);
+    ok = ok && tls_tid > 0;
+    uthread_join(tls_tid, NULL);
+    ok = ok && stale == 0;
+
+    printf("Corrupted stacks: %d\n", corrupted);
+    ok = ok && corrupted == 0;
+
+    if (ok) {
+        printf("Stack arena test PASSED\n");
+    } else {
+        printf("Stack arena test FAILED\n");
+    }
+    return 0;
+}
@@ -0,0 +1,116 @@
+#define _POSIX_C_SOURCE 200809L
+#include "uthread.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fenv.h>
+#include <signal.h>
+#include <errno.h>
+
+#define ROUNDS 20
+
+typedef struct {
+    int id;
+    int round_mode;             // Rounding mode the thread runs with
+    int expect_usr1_blocked;
+    double sum;
+} worker_arg_t;
+
+static int mismatches = 0;
+
+void worker(void *arg) {
+    worker_arg_t *w = arg;
+    fesetround(w->round_mode);
+
+    for (int i = 0; i < ROUNDS; i++) {
+        // Long enough to be preempted, with FP values live in registers
+        double sum = 0.0;
+        for (volatile int j = 0; j < 1000000; j++) {
+            sum += 0.5;
+        }
+        w->sum += sum;
+
+        if (i % 2 == 0) {
+            scheduler_yield();
+        }
+
+        sigset_t current;
+        sigprocmask(SIG_BLOCK, NULL, &current);
+        if (fegetround() != w->round_mode ||
+            sigismember(&current, SIGUSR1) != w->expect_usr1_blocked ||
+            sigismember(&current, SIGALRM)) {
+            mismatches++;
+        }
+    }
+    printf("Thread %d finished\n", w->id);
+}
+
+int main() {
+    printf("=== Thread Attribute Test ===\n");
+    int ok = 1;
+
+    uthread_attr_t attr;
+    uthread_attr_init(&attr);
+    ok = ok && uthread_attr_setfpstate(&attr, 42) == -1;
+    ok = ok && uthread_attr_setaffinity(&attr, 0) == -1;
+
+    // Worker 5 does not exist
+    uthread_attr_setaffinity(&attr, 1UL << 5);
+    ok = ok && uthread_create_attr(&attr, worker, NULL) == -1 && errno == EINVAL;
+
+    // Stacks of the threads below come from the pinned worker's node
+    if (uthread_worker_pin(0) != 0) {
+        printf("Pinning to CPU 0 failed\n");
+        ok = 0;
+    }
+    printf("Worker node: %d\n", uthread_worker_node());
+
+    worker_arg_t args[4] = {
+        {1, FE_UPWARD, 0, 0.0},         // Restricted to worker 0
+        {2, FE_DOWNWARD, 0, 0.0},       // UTHREAD_FP_FULL
+        {3, FE_TOWARDZERO, 1, 0.0},     // Own signal mask
+        {4, FE_TONEAREST, 0, 0.0},      // Default attributes
+    };
+    int tids[4];
+
+    uthread_attr_init(&attr);
+    uthread_attr_setaffinity(&attr, 1UL << 0);
+    tids[0] = uthread_create_attr(&attr, worker, &args[0]);
+
+    uthread_attr_init(&attr);
+    uthread_attr_setfpstate(&attr, UTHREAD_FP_FULL);
+    tids[1] = uthread_create_attr(&attr, worker, &args[1]);
+
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    uthread_attr_init(&attr);
+    uthread_attr_setsigmask(&attr, &usr1);
+    tids[2] = uthread_create_attr(&attr, worker, &args[2]);
+
+    tids[3] = uthread_create_attr(NULL, worker, &args[3]);
+
+    for (int i = 0; i < 4; i++) {
+        if (tids[i] < 0) {
+            printf("Failed to create thread %d\n", i + 1);
+            return 1;
+        }
+    }
+    for (int i = 0; i < 4; i++) {
+        uthread_join(tids[i], NULL);
+        ok = ok && args[i].sum == ROUNDS * 500000.0;
+    }
+
+    // Main keeps its own rounding mode and mask
+    sigset_t current;
+    sigprocmask(SIG_BLOCK, NULL, &current);
+    ok = ok && fegetround() == FE_TONEAREST && !sigismember(&current, SIGUSR1);
+
+    printf("Mismatches: %d (expected: 0)\n", mismatches);
+    if (ok && mismatches == 0) {
+        printf("Thread attribute test PASSED\n");
+    } else {
+        printf("Thread attribute test FAILED\n");
+    }
+    return 0;
+}
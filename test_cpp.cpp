@@ -0,0 +1,139 @@
+#include "uthread.hpp"
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#define NUM_THREADS 4
+#define INCREMENTS 50
+
+// Counts heap allocations, to check that spawning makes none
+static int allocations = 0;
+
+void *operator new(std::size_t size) {
+    allocations++;
+    if (void *p = std::malloc(size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept {
+    std::free(p);
+}
+
+static std::string greet(std::string name, int times) {
+    std::string out;
+    for (int i = 0; i < times; i++) {
+        out += name;
+    }
+    return out;
+}
+
+static mutex_t mutex;
+static rwlock_t rwlock;
+static long counter = 0;
+
+int main() {
+    std::printf("=== C++ API Test ===\n");
+    bool ok = true;
+
+    uthread_mutex_init(&mutex);
+    uthread_rwlock_init(&rwlock);
+
+    // A capture far too big for a register: it lives on the uthread stack
+    std::array<int, 256> data;
+    for (int i = 0; i < 256; i++) {
+        data[i] = i;
+    }
+    int before = allocations;
+    auto sum = uthread::spawn([data] {
+        long total = 0;
+        for (int v : data) {
+            total += v;
+        }
+        return total;
+    });
+    auto words = uthread::spawn(greet, std::string("ab"), 3);
+    int spawn_allocations = allocations - before;
+    std::printf("Allocations while spawning: %d (expected: 0)\n", spawn_allocations);
+    ok = ok && spawn_allocations == 0;
+
+    // Handles move, the result follows
+    auto moved = std::move(sum);
+    ok = ok && !sum.joinable() && moved.joinable();
+    ok = ok && moved.join() == 255 * 256 / 2;
+    ok = ok && words.join() == "ababab";
+
+    // Move-only captures and move-only results
+    auto owned = std::make_unique<int>(42);
+    auto boxed = uthread::spawn([p = std::move(owned)]() mutable {
+        *p += 1;
+        return std::move(p);
+    });
+    std::unique_ptr<int> back = boxed.join();
+    ok = ok && back && *back == 43;
+
+    // Guards keep read-modify-write sequences exclusive across preemption
+    std::vector<uthread::thread<void>> workers;
+    for (int i = 0; i < NUM_THREADS; i++) {
+        workers.push_back(uthread::spawn([] {
+            for (int j = 0; j < INCREMENTS; j++) {
+                {
+                    uthread::mutex_guard guard(mutex);
+                    long value = counter;
+                    for (volatile int k = 0; k < 20000; k++);
+                    counter = value + 1;
+                }
+                uthread::write_guard write(rwlock);
+            }
+        }));
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    {
+        uthread::read_guard read(rwlock);
+        ok = ok && counter == NUM_THREADS * INCREMENTS;
+    }
+
+    // A handle left joinable joins when it goes out of scope
+    int side_effect = 0;
+    {
+        auto scoped = uthread::spawn([&side_effect] { side_effect = 1; });
+    }
+    ok = ok && side_effect == 1;
+
+    // Failures surface as exceptions
+    try {
+        uthread::mutex_guard outer(mutex);
+        uthread::mutex_guard inner(mutex);
+        ok = false;
+    } catch (const std::system_error &e) {
+        ok = ok && e.code().value() == EDEADLK;
+    }
+
+    // Captures over half a default stack are refused
+    try {
+        std::array<char, 8192> big{};
+        uthread::spawn([big] { return big[0]; });
+        ok = false;
+    } catch (const std::system_error &e) {
+        ok = ok && e.code().value() == EINVAL;
+    }
+
+    std::printf("Counter: %ld (expected: %d)\n", counter, NUM_THREADS * INCREMENTS);
+    if (ok) {
+        std::printf("C++ API test PASSED\n");
+    } else {
+        std::printf("C++ API test FAILED\n");
+    }
+    return 0;
+}
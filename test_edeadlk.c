@@ -0,0 +1,94 @@
+#include "uthread.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+
+static mutex_t mutex1, mutex2, mutex3;
+static rwlock_t rwlock;
+static int deadlock_errors = 0;
+static int completed = 0;
+
+static void expect_edeadlk(int ret, const char *what) {
+    if (ret == -1 && errno == EDEADLK) {
+        printf("%s: got EDEADLK\n", what);
+        deadlock_errors++;
+    } else {
+        printf("%s: expected EDEADLK, got %d\n", what, ret);
+    }
+}
+
+void mutex_a(void *arg) {
+    (void)arg;
+    uthread_mutex_lock(&mutex1);
+    scheduler_yield(); // Let mutex_b take mutex2 and block on mutex1
+    expect_edeadlk(uthread_mutex_lock(&mutex2), "mutex cycle");
+    uthread_mutex_unlock(&mutex1);
+}
+
+void mutex_b(void *arg) {
+    (void)arg;
+    uthread_mutex_lock(&mutex2);
+    uthread_mutex_lock(&mutex1);
+    uthread_mutex_unlock(&mutex1);
+    uthread_mutex_unlock(&mutex2);
+    completed++;
+}
+
+void join_main(void *arg) {
+    (void)arg;
+    // Main is blocked joining us
+    expect_edeadlk(uthread_join(0, NULL), "join cycle");
+    completed++;
+}
+
+void rw_reader(void *arg) {
+    (void)arg;
+    uthread_rwlock_rdlock(&rwlock);
+    scheduler_yield(); // Let rw_writer take mutex3 and queue for the write lock
+    expect_edeadlk(uthread_mutex_lock(&mutex3), "rwlock cycle");
+    uthread_rwlock_unlock(&rwlock);
+}
+
+void rw_writer(void *arg) {
+    (void)arg;
+    uthread_mutex_lock(&mutex3);
+    uthread_rwlock_wrlock(&rwlock);
+    uthread_rwlock_unlock(&rwlock);
+    uthread_mutex_unlock(&mutex3);
+    completed++;
+}
+
+int main() {
+    printf("=== EDEADLK Test ===\n");
+
+    uthread_set_deadlock_policy(DEADLOCK_FAIL);
+    uthread_mutex_init(&mutex1);
+    uthread_mutex_init(&mutex2);
+    uthread_mutex_init(&mutex3);
+    uthread_rwlock_init(&rwlock);
+
+    int a = uthread_create(mutex_a, NULL);
+    int b = uthread_create(mutex_b, NULL);
+    uthread_join(a, NULL);
+    uthread_join(b, NULL);
+
+    int c = uthread_create(join_main, NULL);
+    uthread_join(c, NULL);
+
+    int r = uthread_create(rw_reader, NULL);
+    int w = uthread_create(rw_writer, NULL);
+    uthread_join(r, NULL);
+    uthread_join(w, NULL);
+
+    printf("EDEADLK errors: %d (expected: 3), completed: %d (expected: 3)\n",
+           deadlock_errors, completed);
+
+    if (deadlock_errors == 3 && completed == 3) {
+        printf("EDEADLK test PASSED\n");
+    } else {
+        printf("EDEADLK test FAILED\n");
+    }
+
+    return 0;
+}
@@ -0,0 +1,103 @@
+#include "uthread.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#define FAN_OUT 5
+
+static uthread_future_t *promises[3];
+static int woken = 0;
+
+void *square(void *arg) {
+    intptr_t n = (intptr_t)arg;
+    for (volatile int j = 0; j < 5000000 * (FAN_OUT - n); j++); // Finish out of order
+    return (void *)(n * n);
+}
+
+void *fulfil_second(void *arg) {
+    (void)arg;
+    for (volatile int j = 0; j < 10000000; j++);
+    uthread_promise_set(promises[1], (void *)42);
+    return NULL;
+}
+
+void await_promise(void *arg) {
+    void *value = NULL;
+    uthread_await(arg, &value);
+    if ((intptr_t)value == 7) {
+        woken++;
+    }
+}
+
+int main() {
+    printf("=== Future Test ===\n");
+    int ok = 1;
+
+    // Fan-out / fan-in
+    uthread_future_t *futures[FAN_OUT];
+    for (intptr_t i = 0; i < FAN_OUT; i++) {
+        futures[i] = uthread_async(square, (void *)i);
+        if (futures[i] == NULL) {
+            printf("Failed to spawn future %d\n", (int)i);
+            return 1;
+        }
+    }
+
+    uthread_future_t *all = uthread_when_all(futures, FAN_OUT);
+    uthread_await(all, NULL);
+    intptr_t sum = 0;
+    for (int i = 0; i < FAN_OUT; i++) {
+        void *value;
+        ok = ok && uthread_future_ready(futures[i]);
+        uthread_await(futures[i], &value);
+        sum += (intptr_t)value;
+        uthread_future_release(futures[i]);
+    }
+    uthread_future_release(all);
+    printf("Sum of squares: %ld (expected: 30)\n", (long)sum);
+    ok = ok && sum == 30;
+
+    // when_any over promises
+    for (int i = 0; i < 3; i++) {
+        promises[i] = uthread_promise_create();
+    }
+    uthread_future_t *setter = uthread_async(fulfil_second, NULL);
+    uthread_future_t *any = uthread_when_any(promises, 3);
+    void *first = NULL;
+    uthread_await(any, &first);
+    void *value = NULL;
+    uthread_await(first, &value);
+    printf("First ready promise: %d with value %ld (expected: 1 with 42)\n",
+           first == promises[1] ? 1 : -1, (long)(intptr_t)value);
+    ok = ok && first == promises[1] && (intptr_t)value == 42;
+    uthread_future_release(any);
+    uthread_future_release(setter);
+
+    // Several waiters on one promise
+    int tids[2];
+    for (int i = 0; i < 2; i++) {
+        tids[i] = uthread_create(await_promise, promises[0]);
+    }
+    for (volatile int j = 0; j < 10000000; j++); // Let both block
+    uthread_promise_set(promises[0], (void *)7);
+    for (int i = 0; i < 2; i++) {
+        uthread_join(tids[i], NULL);
+    }
+    printf("Waiters woken: %d (expected: 2)\n", woken);
+    ok = ok && woken == 2;
+
+    // Set promises[2] so when_any's link drops its reference, then release
+    uthread_promise_set(promises[2], NULL);
+    for (int i = 0; i < 3; i++) {
+        uthread_future_release(promises[i]);
+    }
+
+    if (ok) {
+        printf("Future test PASSED\n");
+    } else {
+        printf("Future test FAILED\n");
+    }
+
+    return 0;
+}
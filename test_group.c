@@ -0,0 +1,101 @@
+#define _POSIX_C_SOURCE 200809L
+#include "uthread.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+
+#define PER_GROUP 3
+#define RUN_MS 400
+
+static volatile int stop = 0;
+static long work[2 * PER_GROUP];
+
+void spinner(void *arg) {
+    long *count = arg;
+    while (!stop) {
+        for (volatile int j = 0; j < 1000; j++);
+        (*count)++;
+    }
+}
+
+static unsigned gate = 0;
+
+void parked(void *arg) {
+    (void)arg;
+    while (__atomic_load_n(&gate, __ATOMIC_ACQUIRE) == 0) {
+        uthread_wait(&gate, 0, NULL);
+    }
+}
+
+int main() {
+    printf("=== Thread Group Test ===\n");
+    int ok = 1;
+
+    uthread_attr_t attr;
+    uthread_attr_init(&attr);
+    ok = ok && uthread_attr_setgroup(&attr, 1) == -1 && errno == EINVAL;
+    ok = ok && uthread_group_create(0, 0) == -1 && errno == EINVAL;
+
+    // Same thread counts, a 3:1 weight ratio
+    int heavy = uthread_group_create(3 * UTHREAD_GROUP_WEIGHT_DEFAULT, 0);
+    int light = uthread_group_create(UTHREAD_GROUP_WEIGHT_DEFAULT, 0);
+    if (heavy < 0 || light < 0) {
+        printf("Failed to create groups\n");
+        return 1;
+    }
+
+    int tids[2 * PER_GROUP];
+    for (int i = 0; i < 2 * PER_GROUP; i++) {
+        uthread_attr_setgroup(&attr, i < PER_GROUP ? heavy : light);
+        tids[i] = uthread_create_attr(&attr, spinner, &work[i]);
+        if (tids[i] < 0) {
+            printf("Failed to create thread %d\n", i);
+            return 1;
+        }
+    }
+
+    // Let them compete; the timeout is what wakes main up again
+    unsigned never = 0;
+    struct timespec run = { 0, RUN_MS * 1000000L };
+    uthread_wait(&never, 0, &run);
+    stop = 1;
+    for (int i = 0; i < 2 * PER_GROUP; i++) {
+        uthread_join(tids[i], NULL);
+    }
+
+    long heavy_work = 0, light_work = 0;
+    for (int i = 0; i < PER_GROUP; i++) {
+        heavy_work += work[i];
+        light_work += work[PER_GROUP + i];
+    }
+    double ratio = light_work > 0 ? (double)heavy_work / light_work : 0.0;
+    printf("Work: heavy %ld, light %ld, ratio %.2f (expected: ~3)\n",
+           heavy_work, light_work, ratio);
+    ok = ok && ratio > 2.0 && ratio < 4.5;
+
+    // Admission control: the third live thread of a 2-thread group is refused
+    int capped = uthread_group_create(UTHREAD_GROUP_WEIGHT_DEFAULT, 2);
+    uthread_attr_setgroup(&attr, capped);
+    int first = uthread_create_attr(&attr, parked, NULL);
+    int second = uthread_create_attr(&attr, parked, NULL);
+    int third = uthread_create_attr(&attr, parked, NULL);
+    ok = ok && first > 0 && second > 0 && third == -1 && errno == EAGAIN;
+
+    // Room is made as soon as one of them exits
+    __atomic_store_n(&gate, 1, __ATOMIC_RELEASE);
+    uthread_wake(&gate, 2);
+    uthread_join(first, NULL);
+    third = uthread_create_attr(&attr, parked, NULL);
+    ok = ok && third > 0;
+    uthread_join(second, NULL);
+    uthread_join(third, NULL);
+
+    if (ok) {
+        printf("Thread group test PASSED\n");
+    } else {
+        printf("Thread group test FAILED\n");
+    }
+    return 0;
+}
@@ -0,0 +1,78 @@
+#include "uthread.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+static mutex_t mutex1, mutex2;
+static rwlock_t rwlock;
+
+void order_ab(void *arg) {
+    (void)arg;
+    uthread_mutex_lock(&mutex1);
+    uthread_mutex_lock(&mutex2);
+    uthread_mutex_unlock(&mutex2);
+    uthread_mutex_unlock(&mutex1);
+}
+
+void order_ba(void *arg) {
+    (void)arg;
+    // Never actually deadlocks: order_ab has finished by now
+    uthread_mutex_lock(&mutex2);
+    uthread_mutex_lock(&mutex1);
+    uthread_mutex_unlock(&mutex1);
+    uthread_mutex_unlock(&mutex2);
+}
+
+void rw_then_mutex(void *arg) {
+    (void)arg;
+    uthread_rwlock_rdlock(&rwlock);
+    uthread_mutex_lock(&mutex1);
+    uthread_mutex_unlock(&mutex1);
+    uthread_rwlock_unlock(&rwlock);
+}
+
+void mutex_then_rw(void *arg) {
+    (void)arg;
+    uthread_mutex_lock(&mutex1);
+    uthread_rwlock_wrlock(&rwlock);
+    uthread_rwlock_unlock(&rwlock);
+    uthread_mutex_unlock(&mutex1);
+}
+
+int main() {
+    printf("=== Lockdep Test ===\n");
+
+    uthread_mutex_init(&mutex1);
+    uthread_mutex_init(&mutex2);
+    uthread_rwlock_init(&rwlock);
+
+    int tid = uthread_create(order_ab, NULL);
+    uthread_join(tid, NULL);
+    printf("Reports after A->B: %d (expected: 0)\n", uthread_lockdep_reports());
+    int ok = uthread_lockdep_reports() == 0;
+
+    tid = uthread_create(order_ba, NULL);
+    uthread_join(tid, NULL);
+    printf("Reports after B->A: %d (expected: 1)\n", uthread_lockdep_reports());
+    ok = ok && uthread_lockdep_reports() == 1;
+
+    // Repeating the inversion is reported only once
+    tid = uthread_create(order_ba, NULL);
+    uthread_join(tid, NULL);
+    ok = ok && uthread_lockdep_reports() == 1;
+
+    tid = uthread_create(rw_then_mutex, NULL);
+    uthread_join(tid, NULL);
+    tid = uthread_create(mutex_then_rw, NULL);
+    uthread_join(tid, NULL);
+    printf("Reports after rwlock inversion: %d (expected: 2)\n", uthread_lockdep_reports());
+    ok = ok && uthread_lockdep_reports() == 2;
+
+    if (ok) {
+        printf("Lockdep test PASSED\n");
+    } else {
+        printf("Lockdep test FAILED\n");
+    }
+
+    return 0;
+}
@@ -0,0 +1,85 @@
+#include "uthread.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#define N 1000000
+#define CHAIN 1000
+
+static unsigned char visits[N];
+static int chunks = 0;
+
+static int order[CHAIN + 4];
+static int next_order = 0;
+
+void mark_range(size_t begin, size_t end, void *ctx) {
+    (void)ctx;
+    for (size_t i = begin; i < end; i++) {
+        visits[i]++;
+    }
+    __atomic_fetch_add(&chunks, 1, __ATOMIC_RELAXED);
+}
+
+void record(void *arg) {
+    int node = (int)(size_t)arg;
+    order[node] = __atomic_fetch_add(&next_order, 1, __ATOMIC_RELAXED);
+}
+
+int main() {
+    printf("=== Parallel For / Task Graph Test ===\n");
+    int ok = 1;
+
+    // Far more chunks than MAX_THREADS
+    if (uthread_parallel_for(0, N, 100, mark_range, NULL) != 0) {
+        printf("parallel_for failed\n");
+        return 1;
+    }
+    int bad = 0;
+    for (int i = 0; i < N; i++) {
+        bad += visits[i] != 1;
+    }
+    printf("Chunks: %d, elements not visited exactly once: %d (expected: 0)\n", chunks, bad);
+    ok = ok && bad == 0 && chunks >= N / 100;
+
+    // Diamond 0 -> {1, 2} -> 3, then a long chain hanging off 3
+    uthread_graph_t *graph = uthread_graph_create();
+    for (int i = 0; i < CHAIN + 4; i++) {
+        uthread_graph_add(graph, record, (void *)(size_t)i);
+    }
+    uthread_graph_depend(graph, 1, 0);
+    uthread_graph_depend(graph, 2, 0);
+    uthread_graph_depend(graph, 3, 1);
+    uthread_graph_depend(graph, 3, 2);
+    for (int i = 4; i < CHAIN + 4; i++) {
+        uthread_graph_depend(graph, i, i - 1);
+    }
+
+    if (uthread_graph_run(graph) != 0) {
+        printf("graph run failed\n");
+        return 1;
+    }
+    int violations = 0;
+    violations += order[1] < order[0];
+    violations += order[2] < order[0];
+    violations += order[3] < order[1] || order[3] < order[2];
+    for (int i = 4; i < CHAIN + 4; i++) {
+        violations += order[i] < order[i - 1];
+    }
+    printf("Nodes run: %d, order violations: %d (expected: %d, 0)\n",
+           next_order, violations, CHAIN + 4);
+    ok = ok && violations == 0 && next_order == CHAIN + 4;
+
+    // A cycle is rejected before anything runs
+    uthread_graph_depend(graph, 0, CHAIN + 3);
+    next_order = 0;
+    ok = ok && uthread_graph_run(graph) == -1 && next_order == 0;
+    uthread_graph_destroy(graph);
+
+    if (ok) {
+        printf("Parallel test PASSED\n");
+    } else {
+        printf("Parallel test FAILED\n");
+    }
+
+    return 0;
+}
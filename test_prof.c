@@ -0,0 +1,71 @@
+#define _POSIX_C_SOURCE 200809L
+#include "uthread.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+void spin_alpha(void *arg) {
+    (void)arg;
+    for (volatile int j = 0; j < 150000000; j++);
+}
+
+void spin_beta(void *arg) {
+    (void)arg;
+    for (volatile int j = 0; j < 150000000; j++);
+}
+
+int main() {
+    printf("=== Sampling Profiler Test ===\n");
+
+    if (uthread_prof_start(1000) != 0) {
+        printf("Failed to start profiler\n");
+        return 1;
+    }
+
+    int tid1 = uthread_create(spin_alpha, NULL);
+    int tid2 = uthread_create(spin_beta, NULL);
+    if (tid1 < 0 || tid2 < 0) {
+        printf("Failed to create threads\n");
+        return 1;
+    }
+    printf("Created threads: %d (spin_alpha) and %d (spin_beta)\n", tid1, tid2);
+
+    // Wait for threads to complete
+    for (volatile int i = 0; i < 400000000; i++);
+
+    uthread_prof_stop();
+
+    FILE *out = tmpfile();
+    int samples = uthread_prof_dump(fileno(out));
+    printf("Collected %d samples\n", samples);
+
+    char alpha[32], beta[32];
+    snprintf(alpha, sizeof(alpha), "uthread-%d;", tid1);
+    snprintf(beta, sizeof(beta), "uthread-%d;", tid2);
+
+    bool alpha_ok = false, beta_ok = false;
+    char line[4096];
+    rewind(out);
+    while (fgets(line, sizeof(line), out)) {
+        if (strncmp(line, alpha, strlen(alpha)) == 0 && strstr(line, "spin_alpha")) {
+            alpha_ok = true;
+        }
+        if (strncmp(line, beta, strlen(beta)) == 0 && strstr(line, "spin_beta")) {
+            beta_ok = true;
+        }
+        if (strstr(line, "spin_alpha") && strstr(line, "spin_beta")) {
+            alpha_ok = beta_ok = false;
+            break;
+        }
+    }
+    fclose(out);
+
+    if (alpha_ok && beta_ok) {
+        printf("Profiler test PASSED\n");
+    } else {
+        printf("Profiler test FAILED\n");
+    }
+
+    return 0;
+}
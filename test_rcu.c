@@ -0,0 +1,114 @@
+#include "uthread.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#define NUM_READERS 3
+#define READ_ROUNDS 200
+#define UPDATES 50
+
+typedef struct config {
+    uthread_rcu_head_t rcu;
+    int a;
+    int b;                      // Always 2 * a while published
+} config_t;
+
+static config_t *current;
+static config_t *retired[UPDATES];
+static int violations = 0;
+static int reclaimed = 0;
+
+// Poisons instead of freeing, so a reader that is still looking would notice
+static void retire(config_t *config) {
+    config->a = -1;
+    config->b = -1;
+    retired[reclaimed++] = config;
+}
+
+static void reclaim(uthread_rcu_head_t *head) {
+    retire((config_t *)head);
+}
+
+void reader(void *arg) {
+    (void)arg;
+    for (int i = 0; i < READ_ROUNDS; i++) {
+        uthread_rcu_read_lock();
+        config_t *config = uthread_rcu_dereference(current);
+        int a = config->a;
+        for (volatile int j = 0; j < 200000; j++); // Get preempted in here
+        if (a < 0 || config->a != a || config->b != 2 * a) {
+            violations++;
+        }
+        uthread_rcu_read_unlock();
+    }
+}
+
+void writer(void *arg) {
+    (void)arg;
+    for (int i = 1; i <= UPDATES; i++) {
+        config_t *next = malloc(sizeof(*next));
+        next->a = i;
+        next->b = 2 * i;
+        config_t *old = current;
+        uthread_rcu_assign_pointer(current, next);
+
+        // Alternate between waiting here and deferring to the reclaimer
+        if (i % 2 == 0) {
+            uthread_synchronize_rcu();
+            retire(old);
+        } else {
+            uthread_call_rcu(&old->rcu, reclaim);
+        }
+        for (volatile int j = 0; j < 1000000; j++);
+    }
+}
+
+int main() {
+    printf("=== RCU Test ===\n");
+    int ok = 1;
+
+    current = malloc(sizeof(*current));
+    current->a = 0;
+    current->b = 0;
+
+    int tids[NUM_READERS + 1];
+    for (int i = 0; i < NUM_READERS; i++) {
+        tids[i] = uthread_create(reader, NULL);
+    }
+    tids[NUM_READERS] = uthread_create(writer, NULL);
+    for (int i = 0; i <= NUM_READERS; i++) {
+        if (tids[i] < 0) {
+            printf("Failed to create thread %d\n", i);
+            return 1;
+        }
+    }
+    for (int i = 0; i <= NUM_READERS; i++) {
+        uthread_join(tids[i], NULL);
+    }
+
+    // Deferred callbacks run on the reclaimer uthread
+    for (int spins = 0; reclaimed < UPDATES && spins < 1000; spins++) {
+        scheduler_yield();
+    }
+
+    // Waiting for a grace period inside a read-side section cannot work
+    uthread_rcu_read_lock();
+    ok = ok && uthread_synchronize_rcu() == -1 && errno == EDEADLK;
+    uthread_rcu_read_unlock();
+    ok = ok && uthread_synchronize_rcu() == 0;
+
+    printf("Reclaimed: %d (expected: %d), violations: %d (expected: 0)\n",
+           reclaimed, UPDATES, violations);
+    if (ok && reclaimed == UPDATES && violations == 0 && current->a == UPDATES) {
+        printf("RCU test PASSED\n");
+    } else {
+        printf("RCU test FAILED\n");
+    }
+
+    for (int i = 0; i < reclaimed; i++) {
+        free(retired[i]);
+    }
+    free(current);
+    return 0;
+}
@@ -0,0 +1,113 @@
+#define _POSIX_C_SOURCE 200809L
+#include "uthread.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define NUM_READERS 3
+#define READS 2000
+#define WRITES 100
+#define TIMED_READS 1000000
+
+typedef struct {
+    long a;
+    long b;                     // Always -a outside a write
+} record_t;
+
+static uthread_seqlock_t seqlock;
+static record_t record;
+static int torn = 0;
+static int retries = 0;
+
+void reader(void *arg) {
+    (void)arg;
+    for (int i = 0; i < READS; i++) {
+        record_t copy;
+        unsigned seq;
+        int attempts = 0;
+        do {
+            seq = uthread_read_seqbegin(&seqlock);
+            copy.a = record.a;
+            for (volatile int j = 0; j < 20000; j++); // Get preempted in here
+            copy.b = record.b;
+            attempts++;
+        } while (uthread_read_seqretry(&seqlock, seq));
+        retries += attempts - 1;
+        if (copy.b != -copy.a) {
+            torn++;
+        }
+        for (volatile int j = 0; j < 10000; j++);
+    }
+}
+
+void writer(void *arg) {
+    (void)arg;
+    for (int i = 1; i <= WRITES; i++) {
+        uthread_write_seqlock(&seqlock);
+        record.a = i;
+        for (volatile int j = 0; j < 100000; j++); // Get preempted mid-write
+        record.b = -i;
+        uthread_write_sequnlock(&seqlock);
+        for (volatile int j = 0; j < 1000000; j++);
+    }
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main() {
+    printf("=== Seqlock Test ===\n");
+
+    uthread_seqlock_init(&seqlock);
+
+    int tids[NUM_READERS + 1];
+    for (int i = 0; i < NUM_READERS; i++) {
+        tids[i] = uthread_create(reader, NULL);
+    }
+    tids[NUM_READERS] = uthread_create(writer, NULL);
+    for (int i = 0; i <= NUM_READERS; i++) {
+        if (tids[i] < 0) {
+            printf("Failed to create thread %d\n", i);
+            return 1;
+        }
+    }
+    for (int i = 0; i <= NUM_READERS; i++) {
+        uthread_join(tids[i], NULL);
+    }
+
+    // Uncontended read cost against a read-locked rwlock
+    rwlock_t rwlock;
+    uthread_rwlock_init(&rwlock);
+    volatile long sink = 0;
+    double start = now_ns();
+    for (int i = 0; i < TIMED_READS; i++) {
+        unsigned seq;
+        do {
+            seq = uthread_read_seqbegin(&seqlock);
+            sink = record.a;
+        } while (uthread_read_seqretry(&seqlock, seq));
+    }
+    double seq_ns = (now_ns() - start) / TIMED_READS;
+    start = now_ns();
+    for (int i = 0; i < TIMED_READS; i++) {
+        uthread_rwlock_rdlock(&rwlock);
+        sink = record.a;
+        uthread_rwlock_unlock(&rwlock);
+    }
+    double rw_ns = (now_ns() - start) / TIMED_READS;
+    (void)sink;
+    printf("Read cost: seqlock %.1f ns, rwlock %.1f ns\n", seq_ns, rw_ns);
+
+    printf("Torn reads: %d (expected: 0), retries: %d (expected: > 0), final: %ld\n",
+           torn, retries, record.a);
+    if (torn == 0 && retries > 0 && record.a == WRITES && record.b == -WRITES) {
+        printf("Seqlock test PASSED\n");
+    } else {
+        printf("Seqlock test FAILED\n");
+    }
+    return 0;
+}
@@ -0,0 +1,85 @@
+#include "uthread.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ROUNDS 5
+#define DEEP_BYTES 5000
+#define SPIN_BYTES 1024
+
+void shallow(void *arg) {
+    (void)arg;
+}
+
+void deep(void *arg) {
+    volatile char buf[DEEP_BYTES];
+    memset((char *)buf, *(int *)arg, sizeof(buf));
+    scheduler_yield();
+    *(int *)arg = buf[DEEP_BYTES - 1];
+}
+
+void spinner(void *arg) {
+    volatile char buf[SPIN_BYTES];
+    memset((char *)buf, *(int *)arg, sizeof(buf));
+    for (volatile int j = 0; j < 10000000; j++); // Get preempted in here
+    *(int *)arg = buf[SPIN_BYTES - 1];
+}
+
+static int run(void (*routine)(void *)) {
+    int tids[ROUNDS];
+    int args[ROUNDS];
+    for (int i = 0; i < ROUNDS; i++) {
+        args[i] = i + 1;
+        tids[i] = uthread_create(routine, &args[i]);
+        if (tids[i] < 0) {
+            return -1;
+        }
+    }
+    for (int i = 0; i < ROUNDS; i++) {
+        uthread_join(tids[i], NULL);
+    }
+    // Exited stacks are measured when reaped, on the next switch
+    scheduler_yield();
+    for (int i = 0; i < ROUNDS; i++) {
+        if (routine != shallow && args[i] != i + 1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main() {
+    printf("=== Stack Profiling Test ===\n");
+    int ok = 1;
+
+    // Nothing is learned until a policy asks for it
+    ok = ok && run(shallow) == 0;
+    ok = ok && uthread_stack_size_for(shallow) == 8192;
+
+    uthread_set_stack_policy(UTHREAD_STACK_PROFILE);
+    ok = ok && run(shallow) == 0 && run(deep) == 0 && run(spinner) == 0;
+    ok = ok && uthread_stack_size_for(deep) == 8192;
+
+    // Learned sizes follow the recorded peaks, with room for a signal frame
+    uthread_set_stack_policy(UTHREAD_STACK_LEARN);
+    size_t small = uthread_stack_size_for(shallow);
+    size_t large = uthread_stack_size_for(deep);
+    printf("Learned: shallow %zu, deep %zu\n", small, large);
+    ok = ok && small < large && small < 8192 && large > 8192;
+
+    // Threads run on their learned sizes, preempted or not, and keep
+    // being measured
+    ok = ok && run(shallow) == 0 && run(deep) == 0 && run(spinner) == 0;
+    ok = ok && uthread_stack_size_for(deep) == large;
+
+    fflush(stdout);
+    ok = ok && uthread_stack_dump(STDOUT_FILENO) == 3;
+
+    if (ok) {
+        printf("Stack profiling test PASSED\n");
+    } else {
+        printf("Stack profiling test FAILED\n");
+    }
+    return 0;
+}
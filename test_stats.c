@@ -0,0 +1,100 @@
+#define _POSIX_C_SOURCE 200809L
+#include "uthread.h"
+#include "uthread_stats.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#define NUM_WAITERS 3
+#define NUM_SPINNERS 2
+
+static mutex_t mutex;
+static volatile int stop = 0;
+
+void waiter(void *arg) {
+    (void)arg;
+    uthread_mutex_lock(&mutex);
+    uthread_mutex_unlock(&mutex);
+}
+
+void spinner(void *arg) {
+    (void)arg;
+    while (!stop) {
+        for (volatile int j = 0; j < 10000; j++);
+    }
+}
+
+int main() {
+    printf("=== Live Stats Test ===\n");
+    int ok = 1;
+
+    char name[64];
+    snprintf(name, sizeof(name), "/uthread-test-stats-%d", (int)getpid());
+    if (uthread_stats_publish(name) != 0) {
+        perror("uthread_stats_publish");
+        return 1;
+    }
+    ok = ok && uthread_stats_publish(name) == -1 && errno == EBUSY;
+
+    // Read it the way an outside monitor would
+    int fd = shm_open(name, O_RDONLY, 0);
+    const uthread_stats_page_t *page = MAP_FAILED;
+    if (fd >= 0) {
+        page = mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+    }
+    if (page == MAP_FAILED) {
+        printf("Failed to map the stats page\n");
+        return 1;
+    }
+
+    uthread_mutex_init(&mutex);
+    uthread_mutex_lock(&mutex);
+
+    int tids[NUM_WAITERS + NUM_SPINNERS];
+    for (int i = 0; i < NUM_WAITERS + NUM_SPINNERS; i++) {
+        tids[i] = uthread_create(i < NUM_WAITERS ? waiter : spinner, NULL);
+        if (tids[i] < 0) {
+            printf("Failed to create thread %d\n", i);
+            return 1;
+        }
+    }
+
+    // The spinners keep ticks coming while main sleeps
+    unsigned never = 0;
+    struct timespec pause = { 0, 100 * 1000000L };
+    uthread_wait(&never, 0, &pause);
+
+    uthread_stats_page_t s;
+    ok = ok && uthread_stats_read(page, &s, 1000);
+    printf("Live: %u, blocked on mutexes: %u, top lock waiters: %u, switches: %llu\n",
+           s.live, s.blocked[UTHREAD_STATS_MUTEX], s.nlocks ? s.locks[0].waiters : 0,
+           (unsigned long long)s.switches);
+    ok = ok && s.pid == getpid() && s.live == 1 + NUM_WAITERS + NUM_SPINNERS;
+    ok = ok && s.blocked[UTHREAD_STATS_MUTEX] == NUM_WAITERS && s.switches > 0;
+    ok = ok && s.nlocks == 1 && s.locks[0].object == (uint64_t)(uintptr_t)&mutex &&
+         s.locks[0].waiters == NUM_WAITERS;
+    ok = ok && s.nthreads == NUM_WAITERS && s.longest[0].kind == UTHREAD_STATS_MUTEX &&
+         s.longest[0].blocked_ns >= 50 * 1000000ULL;
+
+    uthread_mutex_unlock(&mutex);
+    stop = 1;
+    for (int i = 0; i < NUM_WAITERS + NUM_SPINNERS; i++) {
+        uthread_join(tids[i], NULL);
+    }
+
+    // Unpublishing removes the segment; the existing mapping stays valid
+    ok = ok && uthread_stats_unpublish() == 0;
+    ok = ok && shm_open(name, O_RDONLY, 0) == -1 && errno == ENOENT;
+    munmap((void *)page, sizeof(*page));
+
+    if (ok) {
+        printf("Live stats test PASSED\n");
+    } else {
+        printf("Live stats test FAILED\n");
+    }
+    return 0;
+}
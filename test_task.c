@@ -0,0 +1,87 @@
+#include "uthread.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#define NUM_TASKS 1000
+
+static mutex_t mutex;
+static int counter = 0;
+static int done = 0;
+static int blocked_resumes = 0;
+
+typedef struct {
+    int id;
+} task_state_t;
+
+static task_state_t states[NUM_TASKS];
+
+int task_step(uthread_task_t *task, void *arg) {
+    task_state_t *st = arg;
+
+    UTHREAD_TASK_BEGIN(task);
+
+    UTHREAD_TASK_LOCK(task, &mutex);
+    if (mutex.owner != &task->thread) {
+        printf("Task %d resumed without owning the mutex\n", st->id);
+    }
+
+    // Hold the mutex across a suspension so the other tasks queue up
+    counter++;
+    UTHREAD_TASK_YIELD(task);
+    uthread_mutex_unlock(&mutex);
+
+    done++;
+    UTHREAD_TASK_END(task);
+}
+
+int tracking_step(uthread_task_t *task, void *arg) {
+    (void)arg;
+    UTHREAD_TASK_BEGIN(task);
+    UTHREAD_TASK_LOCK(task, &mutex);
+    blocked_resumes++;
+    uthread_mutex_unlock(&mutex);
+    UTHREAD_TASK_END(task);
+}
+
+void holder(void *arg) {
+    (void)arg;
+    uthread_mutex_lock(&mutex);
+    // Spin long enough for the tasks to run and park on the mutex
+    for (volatile int j = 0; j < 30000000; j++);
+    uthread_mutex_unlock(&mutex);
+}
+
+int main() {
+    printf("=== Stackless Task Test ===\n");
+    printf("Per-task size: %zu bytes\n", (size_t)UTHREAD_TASK_SIZE);
+
+    uthread_mutex_init(&mutex);
+
+    int holder_tid = uthread_create(holder, NULL);
+    scheduler_yield(); // Let the holder take the mutex
+
+    for (int i = 0; i < NUM_TASKS; i++) {
+        states[i].id = i;
+        if (uthread_task_create(task_step, &states[i]) < 0) {
+            printf("Failed to create task %d\n", i);
+            return 1;
+        }
+    }
+    uthread_task_create(tracking_step, NULL);
+
+    uthread_join(holder_tid, NULL);
+    while (done < NUM_TASKS || blocked_resumes < 1) {
+        scheduler_yield();
+    }
+
+    printf("Counter: %d (expected: %d)\n", counter, NUM_TASKS);
+
+    if (counter == NUM_TASKS && UTHREAD_TASK_SIZE < 100) {
+        printf("Stackless task test PASSED\n");
+    } else {
+        printf("Stackless task test FAILED\n");
+    }
+
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include "uthread.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#define NUM_KEYS 10
+
+static uthread_key_t keys[NUM_KEYS];
+static int destructor_calls = 0;
+static int mismatches = 0;
+
+void count_destructor(void *value) {
+    (void)value;
+    destructor_calls++;
+}
+
+void thread_func(void *arg) {
+    int id = *(int *)arg;
+
+    // One inline key and one overflow key per thread
+    uthread_setspecific(keys[0], arg);
+    uthread_setspecific(keys[NUM_KEYS - 1], arg);
+
+    for (int i = 0; i < 5; i++) {
+        for (volatile int j = 0; j < 10000000; j++); // Let the others run
+        int *inline_value = uthread_getspecific(keys[0]);
+        int *overflow_value = uthread_getspecific(keys[NUM_KEYS - 1]);
+        if (inline_value == NULL || overflow_value == NULL ||
+            *inline_value != id || *overflow_value != id) {
+            mismatches++;
+        }
+    }
+    printf("Thread %d finished\n", id);
+}
+
+int main() {
+    printf("=== Uthread-Local Storage Test ===\n");
+
+    for (int i = 0; i < NUM_KEYS; i++) {
+        if (uthread_key_create(&keys[i], count_destructor) != 0) {
+            printf("Failed to create key %d\n", i);
+            return 1;
+        }
+    }
+
+    int ids[3];
+    int tids[3];
+    for (int i = 0; i < 3; i++) {
+        ids[i] = i + 1;
+        tids[i] = uthread_create(thread_func, &ids[i]);
+        if (tids[i] < 0) {
+            printf("Failed to create thread %d\n", i);
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < 3; i++) {
+        uthread_join(tids[i], NULL);
+    }
+
+    printf("Mismatches: %d (expected: 0)\n", mismatches);
+    printf("Destructor calls: %d (expected: 6)\n", destructor_calls);
+
+    if (mismatches == 0 && destructor_calls == 6 &&
+        uthread_getspecific(keys[0]) == NULL) {
+        printf("TLS test PASSED\n");
+    } else {
+        printf("TLS test FAILED\n");
+    }
+
+    return 0;
+}
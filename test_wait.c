@@ -0,0 +1,187 @@
+#define _POSIX_C_SOURCE 200809L
+#include "uthread.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+
+#define NUM_THREADS 4
+#define INCREMENTS 200
+#define NUM_SLEEPERS 3
+
+// Futex-style lock: 0 = free, 1 = held, 2 = held with waiters.
+// Only a contended lock or unlock enters the library.
+static unsigned lock_word = 0;
+static long counter = 0;
+
+static void lock(void) {
+    unsigned c = 0;
+    if (__atomic_compare_exchange_n(&lock_word, &c, 1, false,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    if (c != 2) {
+        c = __atomic_exchange_n(&lock_word, 2, __ATOMIC_ACQUIRE);
+    }
+    while (c != 0) {
+        uthread_wait(&lock_word, 2, NULL);
+        c = __atomic_exchange_n(&lock_word, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+static void unlock(void) {
+    if (__atomic_exchange_n(&lock_word, 0, __ATOMIC_RELEASE) == 2) {
+        uthread_wake(&lock_word, 1);
+    }
+}
+
+void incrementer(void *arg) {
+    (void)arg;
+    for (int i = 0; i < INCREMENTS; i++) {
+        lock();
+        long value = counter;
+        for (volatile int j = 0; j < 20000; j++); // Get preempted holding it
+        counter = value + 1;
+        unlock();
+    }
+}
+
+static unsigned gate = 0;
+static int passed = 0;
+
+void sleeper(void *arg) {
+    (void)arg;
+    while (__atomic_load_n(&gate, __ATOMIC_ACQUIRE) == 0) {
+        uthread_wait(&gate, 0, NULL);
+    }
+    passed++;
+}
+
+static unsigned never = 0;
+static int timed_out = 0;
+
+void timed_waiter(void *arg) {
+    (void)arg;
+    struct timespec timeout = { 0, 20 * 1000000L };
+    if (uthread_wait(&never, 0, &timeout) == -1 && errno == ETIMEDOUT) {
+        __atomic_store_n(&timed_out, 1, __ATOMIC_RELEASE);
+    }
+}
+
+void spinner(void *arg) {
+    (void)arg;
+    while (!__atomic_load_n(&timed_out, __ATOMIC_ACQUIRE)) {
+        for (volatile int j = 0; j < 10000; j++);
+    }
+}
+
+static mutex_t held;
+static int released = 0;
+
+// Sleeps out a timeout with nothing else runnable, holding `held`
+void timed_holder(void *arg) {
+    (void)arg;
+    struct timespec timeout = { 0, 50 * 1000000L };
+    uthread_mutex_lock(&held);
+    scheduler_yield();
+    uthread_wait(&never, 0, &timeout);
+    released = 1;
+    uthread_mutex_unlock(&held);
+}
+
+static int finished = 0;
+
+void short_spinner(void *arg) {
+    (void)arg;
+    for (volatile int j = 0; j < 1000000; j++);
+    finished = 1;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+int main() {
+    printf("=== Wait-on-address Test ===\n");
+    int ok = 1;
+
+    // A lock built on wait/wake keeps increments exclusive
+    int tids[NUM_THREADS];
+    for (int i = 0; i < NUM_THREADS; i++) {
+        tids[i] = uthread_create(incrementer, NULL);
+        if (tids[i] < 0) {
+            printf("Failed to create thread %d\n", i);
+            return 1;
+        }
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+        uthread_join(tids[i], NULL);
+    }
+    printf("Counter: %ld (expected: %d)\n", counter, NUM_THREADS * INCREMENTS);
+    ok = ok && counter == NUM_THREADS * INCREMENTS;
+
+    // A stale expected value fails at once
+    ok = ok && uthread_wait(&gate, 1, NULL) == -1 && errno == EAGAIN;
+    ok = ok && uthread_wake(&gate, -1) == -1 && errno == EINVAL;
+
+    // Wakes are counted and only reach waiters on the same address
+    int sleepers[NUM_SLEEPERS];
+    for (int i = 0; i < NUM_SLEEPERS; i++) {
+        sleepers[i] = uthread_create(sleeper, NULL);
+    }
+    scheduler_yield();
+    __atomic_store_n(&gate, 1, __ATOMIC_RELEASE);
+    ok = ok && uthread_wake(&never, NUM_SLEEPERS) == 0;
+    int first = uthread_wake(&gate, 2);
+    int rest = uthread_wake(&gate, NUM_SLEEPERS);
+    printf("Woken: %d then %d (expected: 2 then %d)\n", first, rest, NUM_SLEEPERS - 2);
+    ok = ok && first == 2 && rest == NUM_SLEEPERS - 2;
+    for (int i = 0; i < NUM_SLEEPERS; i++) {
+        uthread_join(sleepers[i], NULL);
+    }
+    ok = ok && passed == NUM_SLEEPERS;
+
+    // A timed wait expires while other threads keep running
+    int waiter = uthread_create(timed_waiter, NULL);
+    int spin = uthread_create(spinner, NULL);
+    uthread_join(waiter, NULL);
+    uthread_join(spin, NULL);
+    ok = ok && timed_out;
+
+    // Main blocks behind a timed waiter and is not resumed before the wait
+    // expires and the lock is handed over
+    uthread_mutex_init(&held);
+    waiter = uthread_create(timed_holder, NULL);
+    scheduler_yield();
+    double start = now_ms();
+    ok = ok && uthread_mutex_lock(&held) == 0 && released;
+    uthread_mutex_unlock(&held);
+    uthread_join(waiter, NULL);
+    printf("Lock after timed wait: %.1f ms (expected: >= 50)\n", now_ms() - start);
+    ok = ok && now_ms() - start >= 50.0;
+
+    // With nothing else runnable, main sleeps out its own timeout
+    struct timespec timeout = { 0, 30 * 1000000L };
+    start = now_ms();
+    ok = ok && uthread_wait(&never, 0, &timeout) == -1 && errno == ETIMEDOUT;
+    double elapsed = now_ms() - start;
+    printf("Timed wait: %.1f ms (expected: >= 30)\n", elapsed);
+    ok = ok && elapsed >= 30.0;
+
+    // Main is running again, not left queued, so a join really waits
+    spin = uthread_create(short_spinner, NULL);
+    ok = ok && uthread_join(spin, NULL) == 0 && finished;
+
+    // ... and an untimed one could never be woken
+    ok = ok && uthread_wait(&never, 0, NULL) == -1 && errno == EDEADLK;
+
+    if (ok) {
+        printf("Wait-on-address test PASSED\n");
+    } else {
+        printf("Wait-on-address test FAILED\n");
+    }
+    return 0;
+}
@@ -1,5 +1,6 @@
-#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
 #include "uthread.h"
+#include "uthread_stats.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,22 +8,157 @@
 #include <sys/time.h>
 #include <errno.h>
 #include <signal.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/auxv.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 #define STACK_SIZE (8 * 1024)  // 8KB
+#ifndef MAX_THREADS
 #define MAX_THREADS 128
+#endif
 #define QUANTUM_US 10000       // 10ms
+#define CARRIER_STACK_SIZE (64 * 1024) // Stack stackless tasks run on
+#define PARALLEL_HELPERS 4     // Helper tasks per parallel_for / graph run
+#define WORKER_COUNT 1         // Kernel threads running uthreads
+#define MAX_GROUPS 16          // Thread groups, including the default one
+
+#define ARENA_PAGE (2 * 1024 * 1024) // Huge page size the arena is built from
+#define STACK_CANARY 0x5ca1ab1edeadc0deULL
+#define STACK_CANARY_WORDS 8   // Painted at the low end of every stack
+#define STACK_CLASS_MIN (4 * 1024)  // Learned stack sizes, powers of two
+#define STACK_CLASS_MAX (64 * 1024)
+#define SIGNAL_FRAME_MIN 2048       // Kernels that do not report AT_MINSIGSTKSZ
+#define STACK_PROFILE_BITS 6        // Start routines tracked: 1 << bits
+#define STACK_HIST_BUCKETS 8        // Usage up to 512 B << i, the last open
+
+// Where a thread's stack came from (thread_cold_t.stack_source)
+enum {
+    STACK_MAPPED,               // Own mapping, guard pages below it
+    STACK_ARENA                 // Arena slot, kept when the thread exits
+};
+
+#ifndef AT_MINSIGSTKSZ
+#define AT_MINSIGSTKSZ 51
+#endif
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1 << 1)
+#endif
+
+#define LOCKDEP_MAX_CLASSES 256
+
+#ifdef UTHREAD_LOCKDEP
+#define LOCKDEP_CHECK(cls) lockdep_check(cls)
+#define LOCKDEP_PUSH(cls, lock) lockdep_push((cls), (lock))
+#define LOCKDEP_POP(lock) lockdep_pop(lock)
+#else
+#define LOCKDEP_CHECK(cls) ((void)0)
+#define LOCKDEP_PUSH(cls, lock) ((void)0)
+#define LOCKDEP_POP(lock) ((void)0)
+#endif
+
+#define WAIT_BUCKET_BITS 6      // Wait-on-address table has 1 << bits lists
+#define WAIT_BUCKETS (1 << WAIT_BUCKET_BITS)
+
+#define PROF_MAX_DEPTH 32
+#define PROF_BUFFER_SAMPLES 4096 // Must be a power of two
+#define PROF_HANDLER_STACK (16 * 1024) // prof_handler's own frames, on the altstack
+
+// Waiter on a future: either a blocked uthread or a when_all/when_any link
+typedef struct future_waiter {
+    thread_t *thread;                 // Uthread to wake, or NULL for a link
+    struct uthread_future *combinator; // Combinator notified by a link
+    struct uthread_future *source;    // Input future the link watches
+    struct future_waiter *next;
+} future_waiter_t;
+
+struct uthread_future {
+    bool ready;                 // Value has been set
+    void *value;                // Result
+    int refs;                   // User reference + internal ones
+    thread_t *producer;         // Uthread computing the value, if known
+    future_waiter_t *waiters;   // Notified once, when the value is set
+    void *(*fn)(void *);        // uthread_async() body
+    void *arg;
+    bool any;                   // Combinator: when_any instead of when_all
+    int pending;                // Combinator: inputs not yet reported
+    future_waiter_t *links;     // Combinator: one link per input
+};
+
+// Thread group. Ready threads queue in their group; the scheduler picks
+// the ready group that has consumed the least CPU time scaled by its
+// weight, so a burst in one group cannot starve the others.
+typedef struct thread_group {
+    thread_t *head;             // Ready threads, FIFO
+    thread_t *tail;
+    unsigned weight;            // CPU share relative to other groups
+    int max_threads;            // Live uthread limit, 0 = none
+    int live;                   // Live uthreads in the group
+    uint64_t vruntime;          // CPU time in ns, scaled by default/weight
+} thread_group_t;
+
+static thread_group_t groups[MAX_GROUPS] = {
+    [0] = { .weight = UTHREAD_GROUP_WEIGHT_DEFAULT }
+};
+static int group_count = 1;
+static unsigned groups_ready = 0;   // Bit g set while group g has ready threads
+static uint64_t group_clock = 0;    // vruntime of the last group picked
+static uint64_t dispatch_ns = 0;    // When running_thread was switched in
 
-static thread_t *ready_queue = NULL;
 static thread_t *running_thread = NULL;
-static thread_t threads[MAX_THREADS];
+// Descriptor slab. Headers are one cache line each, so scans of the
+// table and queue walks touch a single line per thread; the cold half
+// sits in a parallel array and is only touched on switch, create and exit.
+static thread_t threads[MAX_THREADS] __attribute__((aligned(UTHREAD_CACHE_LINE)));
+static thread_cold_t thread_cold[MAX_THREADS];
+
+_Static_assert(sizeof(thread_t) == UTHREAD_CACHE_LINE,
+               "thread_t header must fill exactly one cache line");
+
 static int next_tid = 1;
 static int thread_count = 0;
 static bool scheduler_initialized = false;
-static ucontext_t main_context;
 static struct itimerval timer;
 static thread_t *thread_to_free = NULL; // Thread to be freed
+static uthread_ctx_t carrier_context;   // Runs stackless tasks
+static char *carrier_stack = NULL;
+static thread_t *carrier_first = NULL;  // Task the carrier starts with
+static volatile sig_atomic_t carrier_active = 0; // Timer ticks are ignored
+static deadlock_policy_t deadlock_policy = DEADLOCK_REPORT;
+static sigset_t default_sigmask;        // Mask of threads without their own
+static int worker_node = -1;            // NUMA node of the pinned worker
+static char *arena_base = NULL;         // Stack arena, see uthread_arena_init()
+static bool arena_hugetlb = false;      // MAP_HUGETLB rather than THP
+static uthread_stack_policy_t stack_policy = UTHREAD_STACK_FIXED;
+static uthread_stats_page_t *stats_page = NULL; // See uthread_stats_publish()
+static uint64_t stats_switches = 0;     // Context switches since start
+#ifdef UTHREAD_FAST_SWITCH
+static bool sigmask_custom = false;     // A thread's own mask is installed
+#endif
+static bool tls_key_used[UTHREAD_KEYS_MAX];
+static unsigned long rcu_gp_seq = 0;    // Grace periods started
+static uthread_rcu_head_t *rcu_callbacks = NULL; // Waiting for the reclaimer
+static uthread_rcu_head_t **rcu_callbacks_tail = &rcu_callbacks;
+static thread_t *rcu_reclaimer = NULL;  // Set once it is running
+static bool rcu_reclaimer_spawned = false;
+static void (*tls_destructors[UTHREAD_KEYS_MAX])(void *);
 
 static void thread_wrapper(void);
+static int create_thread(const uthread_attr_t *attr, void (*start_routine)(void *),
+                         void *arg, size_t arg_size,
+                         void (*construct)(void *arg, void *ctx), void *ctx);
+static void reap_thread_to_free(void);
+static void safe_print_str(const char *s);
+static void safe_print_int(int n);
 static void timer_handler(int sig);
 static void sigquit_handler(int sig);
 static thread_t *find_thread(int tid);
@@ -30,6 +166,20 @@ static void enqueue_thread(thread_t *thread);
 static thread_t *dequeue_thread(void);
 static void unblock_thread(thread_t *thread);
 static void print_deadlock_report(void);
+static uthread_ctx_t *carrier_prepare(thread_t *task);
+static void tls_run_destructors(thread_t *thread);
+static int wfg_check_block(thread_t *self);
+static void wait_expire(void);
+static int wait_idle(void);
+static bool wait_queued(const thread_t *thread);
+static void stats_publish(void);
+#ifdef UTHREAD_LOCKDEP
+static int lockdep_class(const char *file, int line, const void *caller);
+static void lockdep_check(int cls);
+static void lockdep_push(int cls, void *lock);
+static void lockdep_pop(void *lock);
+#endif
+static void prof_handler(int sig, siginfo_t *info, void *ucontext);
 
 static void block_signals(void) {
     sigset_t set;
@@ -38,35 +188,231 @@ static void block_signals(void) {
     sigprocmask(SIG_BLOCK, &set, NULL);
 }
 
+// Also unmasks SIGPROF, which timer_handler() runs with masked: a thread
+// switched to from the handler would otherwise keep it masked
 static void unblock_signals(void) {
     sigset_t set;
     sigemptyset(&set);
     sigaddset(&set, SIGALRM);
+    sigaddset(&set, SIGPROF);
     sigprocmask(SIG_UNBLOCK, &set, NULL);
 }
 
+// Bytes the kernel may need for one signal frame on this CPU (the xsave
+// area makes this several times the classic 2 KB MINSIGSTKSZ with AVX-512).
+// glibc's own MINSIGSTKSZ is a sysconf() call under _GNU_SOURCE.
+static size_t signal_frame_size(void) {
+    size_t size = getauxval(AT_MINSIGSTKSZ);
+    return size > SIGNAL_FRAME_MIN ? size : SIGNAL_FRAME_MIN;
+}
+
+// What a signal frame actually takes below the interrupted stack pointer
+// in this process, entry to the handler included. AT_MINSIGSTKSZ also
+// counts state the process only gets on request (AMX tiles), so this is
+// usually far smaller. 0 until measured, or where it cannot be.
+static size_t signal_frame_used = 0;
+
+static void signal_frame_probe_handler(int sig, siginfo_t *info, void *ucontext) {
+    (void)sig;
+    (void)info;
+    volatile char here = 0;
+    ucontext_t *uc = (ucontext_t *)ucontext;
+    uintptr_t sp;
+#if defined(__x86_64__)
+    sp = (uintptr_t)uc->uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+    sp = (uintptr_t)uc->uc_mcontext.sp;
+#else
+    (void)uc;
+    sp = 0;
+#endif
+    if (sp > (uintptr_t)&here) {
+        signal_frame_used = sp - (uintptr_t)&here;
+    }
+}
+
+// Raises one SIGALRM before the timer handler is installed and measures it
+static void signal_frame_probe(void) {
+    struct sigaction sa, old_sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = signal_frame_probe_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_SIGINFO;
+    sigaction(SIGALRM, &sa, &old_sa);
+
+    sigset_t set, old_set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGALRM);
+    sigprocmask(SIG_UNBLOCK, &set, &old_set);
+    raise(SIGALRM);
+    sigprocmask(SIG_SETMASK, &old_set, NULL);
+    sigaction(SIGALRM, &old_sa, NULL);
+}
+
+// Context switching
+//
+// On x86-64 a switch saves only what the ABI makes callee-saved: rbx,
+// rbp, r12-r15 and the MXCSR and x87 control words. Vector and x87 data
+// registers are caller-saved, so a cooperative switch never has live
+// values in them, and a switch out of timer_handler() has them saved on
+// the signal frame by the kernel. UTHREAD_FP_FULL threads additionally
+// fxsave around their switches, for code that breaks those rules.
+//
+// The signal mask is not swapped. Switches always happen with SIGALRM
+// masked and every resumed path unmasks it itself; threads created with
+// their own mask have it installed when they are switched in. The
+// ucontext fallback saves everything, as swapcontext() always does.
+
+#ifdef UTHREAD_FAST_SWITCH
+#define FP_AREA_SIZE 512        // fxsave image
+
+// uthread_ctx_swap(&from->sp, to->sp)
+void uthread_ctx_swap(void **save_sp, void *load_sp) __attribute__((visibility("hidden")));
+__asm__(
+    ".pushsection .text\n"
+    ".p2align 4\n"
+    ".globl uthread_ctx_swap\n"
+    ".type uthread_ctx_swap, @function\n"
+    "uthread_ctx_swap:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size uthread_ctx_swap, .-uthread_ctx_swap\n"
+    ".popsection\n");
+#endif
+
+// Prepares ctx to start entry on the given stack with SIGALRM masked,
+// to be unmasked by entry when it can be preempted. mask (the rest of
+// the initial signal mask) is only used by the ucontext fallback.
+static void ctx_make(uthread_ctx_t *ctx, void *stack, size_t size,
+                     void (*entry)(void), const sigset_t *mask) {
+#ifdef UTHREAD_FAST_SWITCH
+    (void)mask;
+    uint32_t mxcsr;
+    uint16_t fpucw;
+    __asm__ volatile("stmxcsr %0" : "=m"(mxcsr));
+    __asm__ volatile("fnstcw %0" : "=m"(fpucw));
+
+    // Frame popped by uthread_ctx_swap(); entry sees a 16-byte aligned
+    // call frame whose return address and saved rbp are zero
+    uint64_t *sp = (uint64_t *)(((uintptr_t)stack + size) & ~(uintptr_t)15);
+    *--sp = 0;                          // Return address of entry
+    *--sp = (uint64_t)(uintptr_t)entry; // Taken by the final ret
+    for (int i = 0; i < 6; i++) {
+        *--sp = 0;                      // rbp, rbx, r12-r15
+    }
+    *--sp = (uint64_t)fpucw << 32 | mxcsr;
+    ctx->sp = sp;
+#else
+    getcontext(&ctx->uc);
+    ctx->uc.uc_stack.ss_sp = stack;
+    ctx->uc.uc_stack.ss_size = size;
+    ctx->uc.uc_link = NULL;
+    ctx->uc.uc_sigmask = *mask;
+    sigaddset(&ctx->uc.uc_sigmask, SIGALRM);
+    makecontext(&ctx->uc, entry, 0);
+#endif
+}
+
+// Resumes ctx without saving the current context
+static void ctx_jump(uthread_ctx_t *ctx) {
+#ifdef UTHREAD_FAST_SWITCH
+    void *discard;
+    uthread_ctx_swap(&discard, ctx->sp);
+    __builtin_unreachable();
+#else
+    setcontext(&ctx->uc);
+#endif
+}
+
+// Saves prev's context and resumes ctx; returns when prev is resumed
+static void ctx_switch(thread_t *prev, uthread_ctx_t *ctx) {
+#ifdef UTHREAD_FAST_SWITCH
+    void *fp_area = prev->cold->fp_area;
+    if (fp_area) {
+        __asm__ volatile("fxsave64 (%0)" : : "r"(fp_area) : "memory");
+    }
+    uthread_ctx_swap(&prev->cold->context.sp, ctx->sp);
+    if (fp_area) {
+        __asm__ volatile("fxrstor64 (%0)" : : "r"(fp_area) : "memory");
+    }
+#else
+    swapcontext(&prev->cold->context.uc, &ctx->uc);
+#endif
+}
+
+// Installs the signal mask next runs with, if it differs from the one in
+// effect. SIGALRM stays masked for the resumed path to unmask.
+static void sigmask_switch(thread_t *next) {
+#ifdef UTHREAD_FAST_SWITCH
+    bool custom = next->kind != THREAD_KIND_TASK && next->cold->has_sigmask;
+    if (!custom && !sigmask_custom) {
+        return;
+    }
+    sigset_t set = custom ? next->cold->sigmask : default_sigmask;
+    sigaddset(&set, SIGALRM);
+    sigprocmask(SIG_SETMASK, &set, NULL);
+    sigmask_custom = custom;
+#else
+    (void)next;                 // swapcontext() restores each thread's own
+#endif
+}
+
 void scheduler_init(void) {
     if (scheduler_initialized) return;
     
+    for (int i = 0; i < MAX_THREADS; i++) {
+        threads[i].cold = &thread_cold[i];
+    }
+
     running_thread = &threads[0];
     running_thread->tid = 0;
     running_thread->state = THREAD_RUNNING;
-    running_thread->stack = NULL;
-    running_thread->start_routine = NULL;
-    running_thread->arg = NULL;
+    running_thread->kind = THREAD_KIND_STACKFUL;
+    running_thread->cold->stack = NULL;
+    running_thread->cold->start_routine = NULL;
+    running_thread->cold->arg = NULL;
     running_thread->next = NULL;
     running_thread->waiting_for = NULL;
     running_thread->blocked_on = NULL;
     running_thread->blocked_on_rw = NULL;
-    getcontext(&running_thread->context);
-    getcontext(&main_context);
+    running_thread->blocked_on_future = NULL;
+    memset(running_thread->cold->read_holds, 0, sizeof(running_thread->cold->read_holds));
+#ifdef UTHREAD_LOCKDEP
+    running_thread->cold->held.count = 0;
+#endif
     thread_count = 1;
+    groups[0].live = 1;
+
+    sigprocmask(SIG_BLOCK, NULL, &default_sigmask);
+    sigdelset(&default_sigmask, SIGALRM);
+
+    signal_frame_probe();
     
     struct sigaction sa;
     memset(&sa, 0, sizeof(sa));
     sa.sa_handler = timer_handler;
     sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART; 
+    sigaddset(&sa.sa_mask, SIGPROF); // Never stack a sample on a tick frame
+    sa.sa_flags = SA_RESTART;
     sigaction(SIGALRM, &sa, NULL);
 
     struct sigaction sa_quit;
@@ -89,6 +435,13 @@ void scheduler_init(void) {
 
 static void timer_handler(int sig) {
     (void)sig;
+    if (carrier_active) {
+        return;
+    }
+    wait_expire();
+    if (stats_page != NULL) {
+        stats_publish();
+    }
     scheduler_yield();
 }
 
@@ -107,654 +460,3334 @@ static thread_t *find_thread(int tid) {
 }
 
 static void enqueue_thread(thread_t *thread) {
-    if (ready_queue == NULL) {
-        ready_queue = thread;
-        thread->next = NULL;
-    } else {
-        thread_t *current = ready_queue;
-        while (current->next != NULL) {
-            current = current->next;
+    thread_group_t *group = &groups[thread->group];
+    thread->next = NULL;
+    if (group->head == NULL) {
+        group->head = thread;
+        groups_ready |= 1u << thread->group;
+        // Time spent idle is not credit to burst with later
+        if (group->vruntime < group_clock) {
+            group->vruntime = group_clock;
         }
-        current->next = thread;
-        thread->next = NULL;
+    } else {
+        group->tail->next = thread;
     }
+    group->tail = thread;
 }
 
 static thread_t *dequeue_thread(void) {
-    if (ready_queue == NULL) {
+    if (groups_ready == 0) {
         return NULL;
     }
-    thread_t *thread = ready_queue;
-    ready_queue = ready_queue->next;
+
+    int g = __builtin_ctz(groups_ready);
+    for (unsigned rest = groups_ready & (groups_ready - 1); rest != 0; rest &= rest - 1) {
+        int i = __builtin_ctz(rest);
+        if (groups[i].vruntime < groups[g].vruntime) {
+            g = i;
+        }
+    }
+    thread_group_t *group = &groups[g];
+    group_clock = group->vruntime;
+
+    thread_t *thread = group->head;
+    group->head = thread->next;
+    if (group->head == NULL) {
+        group->tail = NULL;
+        groups_ready &= ~(1u << g);
+    }
     thread->next = NULL;
     return thread;
 }
 
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Charges the time since the last switch to the running thread's group.
+// Only done once groups exist, so ungrouped programs never read the clock.
+static void group_charge(void) {
+    uint64_t now = monotonic_ns();
+    if (running_thread != NULL) {
+        thread_group_t *group = &groups[running_thread->group];
+        group->vruntime += (now - dispatch_ns) * UTHREAD_GROUP_WEIGHT_DEFAULT / group->weight;
+    }
+    dispatch_ns = now;
+}
+
 static void unblock_thread(thread_t *thread) {
     if (thread && thread->state == THREAD_BLOCKED) {
         thread->state = THREAD_READY;
         thread->blocked_on = NULL;
         thread->blocked_on_rw = NULL;
+        thread->blocked_on_future = NULL;
+        thread->waiting_for = NULL;
         enqueue_thread(thread);
     }
 }
 
-int uthread_create(void (*start_routine)(void *), void *arg) {
-    block_signals();
+// Blocks the running thread at the tail of a wait list until whoever
+// takes it off the list makes it runnable. Called with SIGALRM masked,
+// after the wait edge has been set and checked.
+static void park_on(thread_t **list) {
+    thread_t **link = list;
+    while (*link != NULL) {
+        link = &(*link)->next;
+    }
+    running_thread->state = THREAD_BLOCKED;
+    running_thread->next = NULL;
+    *link = running_thread;
+    scheduler_schedule();
+}
 
-    if (!scheduler_initialized) {
-        scheduler_init();
+// Wakes every thread of a wait list (linked through next, all blocked)
+// and, when they share a group, splices the list onto its ready queue in
+// one step, keeping their order
+static void wake_all(thread_t *list) {
+    if (list == NULL) {
+        return;
     }
-    
-    if (thread_count >= MAX_THREADS) {
-        unblock_signals();
-        return -1;
+
+    thread_t *tail = list;
+    bool one_group = true;
+    for (thread_t *thread = list; thread != NULL; thread = thread->next) {
+        thread->state = THREAD_READY;
+        thread->blocked_on = NULL;
+        thread->blocked_on_rw = NULL;
+        thread->blocked_on_future = NULL;
+        thread->waiting_for = NULL;
+        one_group = one_group && thread->group == list->group;
+        tail = thread;
     }
-    
-    // Find free slot
-    thread_t *new_thread = NULL;
-    for (int i = 1; i < MAX_THREADS; i++) {
-        if (threads[i].tid == 0 || threads[i].state == THREAD_TERMINATED) {
-            new_thread = &threads[i];
-            break;
+
+    if (!one_group) {
+        while (list != NULL) {
+            thread_t *next = list->next;
+            enqueue_thread(list);
+            list = next;
         }
+        return;
     }
-    
-    if (new_thread == NULL) {
-        unblock_signals();
+
+    // Queue the first thread as usual, then hang the rest behind it
+    thread_t *rest = list->next;
+    enqueue_thread(list);
+    list->next = rest;
+    groups[list->group].tail = tail;
+}
+
+int uthread_attr_init(uthread_attr_t *attr) {
+    if (attr == NULL) {
         return -1;
     }
-    
-    // Allocate stack
-    new_thread->stack = malloc(STACK_SIZE);
-    if (new_thread->stack == NULL) {
+    attr->fp_state = UTHREAD_FP_LAZY;
+    attr->workers = UTHREAD_WORKER_ALL;
+    attr->has_sigmask = false;
+    sigemptyset(&attr->sigmask);
+    attr->group = 0;
+    return 0;
+}
+
+int uthread_attr_setfpstate(uthread_attr_t *attr, int fp_state) {
+    if (attr == NULL || (fp_state != UTHREAD_FP_LAZY && fp_state != UTHREAD_FP_FULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+    attr->fp_state = fp_state;
+    return 0;
+}
+
+int uthread_attr_setsigmask(uthread_attr_t *attr, const sigset_t *mask) {
+    if (attr == NULL || mask == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    attr->has_sigmask = true;
+    attr->sigmask = *mask;
+    sigdelset(&attr->sigmask, SIGALRM);
+    return 0;
+}
+
+int uthread_attr_setaffinity(uthread_attr_t *attr, unsigned long workers) {
+    if (attr == NULL || workers == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    attr->workers = workers;
+    return 0;
+}
+
+int uthread_attr_setgroup(uthread_attr_t *attr, int group) {
+    if (attr == NULL || group < 0 || group >= group_count) {
+        errno = EINVAL;
+        return -1;
+    }
+    attr->group = group;
+    return 0;
+}
+
+int uthread_group_create(unsigned weight, int max_threads) {
+    if (weight == 0 || max_threads < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    block_signals();
+
+    if (group_count == MAX_GROUPS) {
         unblock_signals();
+        errno = EAGAIN;
         return -1;
     }
-    
-    new_thread->tid = next_tid++;
-    new_thread->state = THREAD_READY;
-    new_thread->stack_size = STACK_SIZE;
-    new_thread->retval = NULL;
-    new_thread->start_routine = start_routine;
-    new_thread->arg = arg;
-    new_thread->next = NULL;
-    new_thread->waiting_for = NULL;
-    new_thread->blocked_on = NULL;
-    new_thread->blocked_on_rw = NULL;
-    new_thread->is_writer = false;
-    
-    getcontext(&new_thread->context);
-    new_thread->context.uc_stack.ss_sp = new_thread->stack;
-    new_thread->context.uc_stack.ss_size = STACK_SIZE;
-    new_thread->context.uc_link = NULL; 
-    
-    sigemptyset(&new_thread->context.uc_sigmask);
-    
-    makecontext(&new_thread->context, (void (*)(void))thread_wrapper, 0);
-    
-    enqueue_thread(new_thread);
-    thread_count++;
-    
+
+    // Time is charged from the first switch after the first group exists
+    if (group_count == 1) {
+        dispatch_ns = monotonic_ns();
+    }
+
+    int id = group_count++;
+    groups[id].weight = weight;
+    groups[id].max_threads = max_threads;
+    groups[id].vruntime = group_clock;
     unblock_signals();
-    return new_thread->tid;
+    return id;
 }
 
-static void thread_wrapper(void) {
-    if (running_thread && running_thread->start_routine) {
-        running_thread->start_routine(running_thread->arg);
+// Worker placement
+//
+// uthread_worker_pin() binds the worker to one CPU and makes memory it
+// uses preferably come from that CPU's node: the descriptor slabs and
+// the carrier stack are migrated there, and stacks of threads created
+// afterwards are mapped with the same preference.
+// Placement is best effort; kernels without NUMA support just pin.
+
+// Prefers node for [addr, addr + len), moving pages already touched.
+// Only whole pages inside the range are affected.
+static void memory_prefer_node(void *addr, size_t len, int node) {
+    if (node < 0 || node >= (int)(8 * sizeof(unsigned long))) {
+        return;
     }
-    uthread_exit(NULL);
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t lo = ((uintptr_t)addr + page - 1) & ~(page - 1);
+    uintptr_t hi = ((uintptr_t)addr + len) & ~(page - 1);
+    if (lo >= hi) {
+        return;
+    }
+    unsigned long nodemask = 1UL << node;
+    syscall(SYS_mbind, (void *)lo, hi - lo, MPOL_PREFERRED, &nodemask,
+            8 * sizeof(nodemask) + 1, MPOL_MF_MOVE);
 }
 
+// Room below a stack that a signal frame landing near its low end may
+// write into: whole pages covering the largest frame the kernel reports
+static size_t stack_guard_size(void) {
+    static size_t guard = 0;
+    if (guard == 0) {
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        guard = (signal_frame_size() + page - 1) & ~(page - 1);
+    }
+    return guard;
+}
 
-void scheduler_yield(void) {
-    if (running_thread == NULL) return;
-    
-    if (running_thread->tid == 0) {
-        getcontext(&main_context);
-    } else {
-        getcontext(&running_thread->context);
+static void *stack_alloc(thread_cold_t *cold, size_t size) {
+    if (cold->stack_source == STACK_ARENA) {
+        return cold->stack;
     }
-    
-    if (running_thread->state == THREAD_RUNNING) {
-        running_thread->state = THREAD_READY;
-        enqueue_thread(running_thread);
-        scheduler_schedule();
+    size_t guard = stack_guard_size();
+    char *base = mmap(NULL, guard + size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    if (mprotect(base, guard, PROT_NONE) != 0) {
+        munmap(base, guard + size);
+        return NULL;
     }
+    memory_prefer_node(base + guard, size, worker_node);
+    cold->stack_source = STACK_MAPPED;
+    return base + guard;
 }
 
-void scheduler_schedule(void) {
-    // Free pending stack from previous terminated thread
-    if (thread_to_free != NULL) {
-        if (thread_to_free->stack) {
-            free(thread_to_free->stack);
-            thread_to_free->stack = NULL;
+static void stack_free(thread_cold_t *cold) {
+    if (cold->stack_source == STACK_ARENA) {
+        return;                 // Pooled for the next thread in this slot
+    }
+    size_t guard = stack_guard_size();
+    munmap((char *)cold->stack - guard, guard + cold->stack_size);
+    cold->stack = NULL;
+}
+
+// Arena stacks have a redzone below them but no guard page (one would
+// split a huge page), so a canary at the low end of every stack is also
+// checked whenever the thread switches out.
+// Profiled stacks are painted whole so the untouched part can be measured.
+static void stack_paint(thread_cold_t *cold, bool whole) {
+    uint64_t *bottom = cold->stack;
+    size_t words = whole ? cold->stack_size / sizeof(uint64_t) : STACK_CANARY_WORDS;
+    for (size_t i = 0; i < words; i++) {
+        bottom[i] = STACK_CANARY;
+    }
+    cold->stack_painted = whole;
+}
+
+static void stack_check(thread_t *thread) {
+    uint64_t *bottom = thread->cold->stack;
+    for (int i = 0; i < STACK_CANARY_WORDS; i++) {
+        if (bottom[i] != STACK_CANARY) {
+            safe_print_str("Stack overflow in thread ");
+            safe_print_int(thread->tid);
+            safe_print_str("\n");
+            abort();
         }
-        thread_to_free = NULL;
     }
+}
 
-    thread_t *next = dequeue_thread();
-    
-    // If no threads are ready, switch to main thread
-    if (next == NULL) {
-        if (running_thread && running_thread->tid == 0) {
-            return;
+// Stack profiles
+//
+// One record per start routine, in an open-addressed table; routines past
+// its capacity are simply not profiled. Peaks only grow, so a learned
+// size never drops below a depth the routine has actually reached.
+
+typedef struct stack_profile {
+    void (*routine)(void *);
+    unsigned samples;           // Threads measured
+    size_t peak;                // Deepest usage seen, in bytes
+    unsigned hist[STACK_HIST_BUCKETS];
+} stack_profile_t;
+
+static stack_profile_t stack_profiles[1 << STACK_PROFILE_BITS];
+
+static stack_profile_t *stack_profile_find(void (*routine)(void *), bool insert) {
+    uint64_t key = (uint64_t)(uintptr_t)routine;
+    unsigned mask = (1u << STACK_PROFILE_BITS) - 1;
+    unsigned i = (unsigned)((key * 0x9e3779b97f4a7c15ULL) >> (64 - STACK_PROFILE_BITS));
+    for (unsigned probe = 0; probe <= mask; probe++, i = (i + 1) & mask) {
+        if (stack_profiles[i].routine == routine) {
+            return &stack_profiles[i];
         }
-        
-        thread_t *prev = running_thread;
-        running_thread = &threads[0];
-        running_thread->state = THREAD_RUNNING;
-        
-        if (prev->state == THREAD_TERMINATED) {
-            thread_to_free = prev;
-            setcontext(&main_context);
-        } else {
-            swapcontext(&prev->context, &main_context);
+        if (stack_profiles[i].routine == NULL) {
+            if (!insert) {
+                return NULL;
+            }
+            stack_profiles[i].routine = routine;
+            return &stack_profiles[i];
         }
+    }
+    return NULL;
+}
+
+// Bytes of a painted stack that were written, from the top down
+static size_t stack_high_water(const thread_cold_t *cold) {
+    const uint64_t *bottom = cold->stack;
+    size_t words = cold->stack_size / sizeof(uint64_t);
+    size_t i = STACK_CANARY_WORDS;
+    while (i < words && bottom[i] == STACK_CANARY) {
+        i++;
+    }
+    return (words - i) * sizeof(uint64_t);
+}
+
+static void stack_record(const thread_cold_t *cold) {
+    if (!cold->stack_painted || cold->start_routine == NULL) {
         return;
     }
-    
-    thread_t *prev = running_thread;
-    running_thread = next;
-    running_thread->state = THREAD_RUNNING;
-    
-    ucontext_t *prev_ctx;
-    if (prev == NULL || prev->tid == 0) {
-        prev_ctx = &main_context;
-    } else {
-        prev_ctx = &prev->context;
+    stack_profile_t *profile = stack_profile_find(cold->start_routine, true);
+    if (profile == NULL) {
+        return;
     }
-    
-    ucontext_t *next_ctx = (running_thread->tid == 0) ? &main_context : &running_thread->context;
 
-    if (prev && prev->state == THREAD_TERMINATED) {
-        thread_to_free = prev;
-        setcontext(next_ctx);
-    } else {
-        swapcontext(prev_ctx, next_ctx);
+    size_t used = stack_high_water(cold);
+    int bucket = 0;
+    while (bucket < STACK_HIST_BUCKETS - 1 && used > ((size_t)512 << bucket)) {
+        bucket++;
+    }
+    profile->samples++;
+    profile->hist[bucket]++;
+    if (used > profile->peak) {
+        profile->peak = used;
     }
 }
 
-int uthread_self(void) {
-    if (running_thread == NULL) {
-        return 0;
+// A tick can land at the deepest point of a later run that none of the
+// measured ones was preempted at, so the peak gets room for one signal
+// frame as this process actually takes them
+static size_t stack_learned_size(const stack_profile_t *profile) {
+    size_t frame = signal_frame_used ? signal_frame_used : signal_frame_size();
+    size_t need = profile->peak + profile->peak / 4 + frame;
+    size_t size = STACK_CLASS_MIN;
+    while (size < need && size < STACK_CLASS_MAX) {
+        size *= 2;
     }
-    return running_thread->tid;
+    return size;
 }
 
-void uthread_exit(void *retval) {
+static size_t stack_size_for(void (*routine)(void *)) {
+    if (stack_policy != UTHREAD_STACK_LEARN) {
+        return STACK_SIZE;
+    }
+    stack_profile_t *profile = stack_profile_find(routine, false);
+    if (profile == NULL || profile->samples == 0) {
+        return STACK_SIZE;
+    }
+    return stack_learned_size(profile);
+}
+
+void uthread_set_stack_policy(uthread_stack_policy_t policy) {
     block_signals();
+    stack_policy = policy;
+    unblock_signals();
+}
 
-    if (running_thread == NULL || running_thread->tid == 0) {
-        exit(0);
-    }
-    
-    running_thread->retval = retval;
-    running_thread->state = THREAD_TERMINATED;
-    
-    for (int i = 0; i < MAX_THREADS; i++) {
-        if (threads[i].state != THREAD_TERMINATED && threads[i].waiting_for == running_thread) {
-            unblock_thread(&threads[i]);
+size_t uthread_stack_size_for(void (*start_routine)(void *)) {
+    block_signals();
+    size_t size = stack_size_for(start_routine);
+    unblock_signals();
+    return size;
+}
+
+// Writes "<routine> <samples> <peak> <learned size> <histogram...>" per
+// profiled routine; histogram bucket i counts exits using up to 512 B << i
+int uthread_stack_dump(int fd) {
+    block_signals();
+    int routines = 0;
+    dprintf(fd, "# routine samples peak learned hist(512B<<i)\n");
+    for (int i = 0; i < 1 << STACK_PROFILE_BITS; i++) {
+        stack_profile_t *profile = &stack_profiles[i];
+        if (profile->routine == NULL || profile->samples == 0) {
+            continue;
+        }
+        Dl_info info;
+        void *addr = (void *)(uintptr_t)profile->routine;
+        if (dladdr(addr, &info) && info.dli_sname) {
+            dprintf(fd, "%s", info.dli_sname);
+        } else {
+            dprintf(fd, "0x%lx", (unsigned long)(uintptr_t)addr);
+        }
+        dprintf(fd, " %u %zu %zu", profile->samples, profile->peak,
+                stack_learned_size(profile));
+        for (int b = 0; b < STACK_HIST_BUCKETS; b++) {
+            dprintf(fd, " %u", profile->hist[b]);
         }
+        dprintf(fd, "\n");
+        routines++;
     }
-    
-    thread_count--;
-    
-    scheduler_schedule();
-    exit(1);
+    unblock_signals();
+    return routines;
 }
 
-int uthread_join(int tid, void **retval) {
+// Stack arena
+//
+// The arena starts with the cold descriptors of the first `slots` thread
+// slots, followed by one stack per slot. Each stack sits above a redzone
+// as large as a signal frame, so a tick that lands near the low end of a
+// stack writes into the redzone rather than into a descriptor or another
+// thread's stack. The mapping uses MAP_HUGETLB when huge pages are
+// reserved and falls back to an aligned mapping advised for transparent
+// huge pages otherwise.
+
+int uthread_arena_init(size_t slots) {
     block_signals();
 
-    thread_t *target = find_thread(tid);
-    
-    if (target == NULL) {
+    if (!scheduler_initialized) {
+        scheduler_init();
+    }
+
+    bool threads_created = false;
+    for (int i = 1; i < MAX_THREADS; i++) {
+        threads_created = threads_created || threads[i].tid != 0;
+    }
+    if (arena_base != NULL || threads_created) {
         unblock_signals();
+        errno = EBUSY;
         return -1;
     }
-    
-    if (target->state == THREAD_TERMINATED) {
-        if (retval) {
-            *retval = target->retval;
-        }
+    if (slots == 0) {
         unblock_signals();
-        return 0;
+        errno = EINVAL;
+        return -1;
     }
-    
-    running_thread->state = THREAD_BLOCKED;
-    running_thread->waiting_for = target;
-    
-    thread_t *prev = running_thread;
-    if (prev->tid == 0) {
-        getcontext(&main_context);
-    } else {
-        getcontext(&prev->context);
+    if (slots > MAX_THREADS - 1) {
+        slots = MAX_THREADS - 1;
     }
-    
-    if (running_thread->state == THREAD_BLOCKED && running_thread->waiting_for == target) {
-        scheduler_schedule();
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t cold_size = (sizeof(thread_cold_t) + UTHREAD_CACHE_LINE - 1) &
+                       ~(size_t)(UTHREAD_CACHE_LINE - 1);
+    size_t colds_size = (slots * cold_size + page - 1) & ~(page - 1);
+    size_t slot_size = stack_guard_size() + STACK_SIZE;
+    size_t size = (colds_size + slots * slot_size + ARENA_PAGE - 1) &
+                  ~(size_t)(ARENA_PAGE - 1);
+
+    char *base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    arena_hugetlb = base != MAP_FAILED;
+    if (base == MAP_FAILED) {
+        // Over-map so that a 2 MB aligned run can be kept
+        char *raw = mmap(NULL, size + ARENA_PAGE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) {
+            unblock_signals();
+            return -1;
+        }
+        base = (char *)(((uintptr_t)raw + ARENA_PAGE - 1) & ~(uintptr_t)(ARENA_PAGE - 1));
+        if (base > raw) {
+            munmap(raw, base - raw);
+        }
+        munmap(base + size, raw + ARENA_PAGE - base);
+        madvise(base, size, MADV_HUGEPAGE);
     }
-    
-    if (retval) {
-        *retval = target->retval;
+    memory_prefer_node(base, size, worker_node);
+
+    for (size_t i = 0; i < slots; i++) {
+        thread_cold_t *cold = (thread_cold_t *)(base + i * cold_size);
+        cold->stack = base + colds_size + i * slot_size + stack_guard_size();
+        cold->stack_size = STACK_SIZE;
+        cold->stack_source = STACK_ARENA;
+        threads[i + 1].cold = cold;
     }
-    
+    arena_base = base;
+
     unblock_signals();
     return 0;
 }
 
-int uthread_mutex_init(mutex_t *mutex) {
-    if (mutex == NULL) {
+bool uthread_arena_hugetlb(void) {
+    return arena_hugetlb;
+}
+
+int uthread_worker_pin(int cpu) {
+    cpu_set_t set;
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        errno = EINVAL;
         return -1;
     }
-    mutex->locked = 0;
-    mutex->owner = NULL;
-    mutex->waiting_list = NULL;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        return -1;
+    }
+
+    block_signals();
+
+    if (!scheduler_initialized) {
+        scheduler_init();
+    }
+
+    unsigned current_cpu, node;
+    worker_node = getcpu(&current_cpu, &node) == 0 ? (int)node : -1;
+    memory_prefer_node(threads, sizeof(threads), worker_node);
+    memory_prefer_node(thread_cold, sizeof(thread_cold), worker_node);
+    if (carrier_stack) {
+        memory_prefer_node(carrier_stack, CARRIER_STACK_SIZE, worker_node);
+    }
+
+    unblock_signals();
     return 0;
 }
 
-int uthread_mutex_lock(mutex_t *mutex) {
-    block_signals();
+int uthread_worker_node(void) {
+    return worker_node;
+}
 
-    if (mutex == NULL || running_thread == NULL) {
-        unblock_signals();
+int uthread_create(void (*start_routine)(void *), void *arg) {
+    return uthread_create_attr(NULL, start_routine, arg);
+}
+
+int uthread_create_attr(const uthread_attr_t *attr,
+                        void (*start_routine)(void *), void *arg) {
+    return create_thread(attr, start_routine, arg, 0, NULL, NULL);
+}
+
+int uthread_create_inplace(const uthread_attr_t *attr, void (*start_routine)(void *),
+                           size_t arg_size, void (*construct)(void *arg, void *ctx),
+                           void *ctx) {
+    if (arg_size == 0 || construct == NULL) {
+        errno = EINVAL;
         return -1;
     }
+    return create_thread(attr, start_routine, NULL, arg_size, construct, ctx);
+}
+
+// With `construct`, the argument is built in arg_size bytes (rounded up to
+// 16) taken off the top of the new stack rather than passed in
+static int create_thread(const uthread_attr_t *attr, void (*start_routine)(void *),
+                         void *arg, size_t arg_size,
+                         void (*construct)(void *arg, void *ctx), void *ctx) {
+    uthread_attr_t defaults;
+    if (attr == NULL) {
+        uthread_attr_init(&defaults);
+        attr = &defaults;
+    }
+
+    // The worker set must name at least one worker that exists, and an
+    // in-place argument may take at most half of a default stack
+    if ((attr->workers & ((1UL << WORKER_COUNT) - 1)) == 0 ||
+        (construct != NULL && arg_size > STACK_SIZE / 2)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    block_signals();
+
+    if (!scheduler_initialized) {
+        scheduler_init();
+    }
     
-    if (mutex->locked == 0) {
-        mutex->locked = 1;
-        mutex->owner = running_thread;
+    if (thread_count >= MAX_THREADS) {
         unblock_signals();
-        return 0;
+        return -1;
     }
-    
-    if (mutex->owner == running_thread) {
+
+    thread_group_t *group = &groups[attr->group];
+    if (group->max_threads > 0 && group->live >= group->max_threads) {
         unblock_signals();
+        errno = EAGAIN;
         return -1;
     }
     
-    running_thread->state = THREAD_BLOCKED;
-    running_thread->blocked_on = mutex;
-    
-    if (mutex->waiting_list == NULL) {
-        mutex->waiting_list = running_thread;
-        running_thread->next = NULL;
-    } else {
-        thread_t *current = mutex->waiting_list;
-        while (current->next != NULL) {
-            current = current->next;
+    // The slot found below may still have its stack pending
+    reap_thread_to_free();
+
+    // Find free slot
+    thread_t *new_thread = NULL;
+    for (int i = 1; i < MAX_THREADS; i++) {
+        if (threads[i].tid == 0 || threads[i].state == THREAD_TERMINATED) {
+            new_thread = &threads[i];
+            break;
         }
-        current->next = running_thread;
-        running_thread->next = NULL;
-    }
-    
-    thread_t *prev = running_thread;
-    if (prev->tid == 0) {
-        getcontext(&main_context);
-    } else {
-        getcontext(&prev->context);
     }
     
-    if (running_thread->state == THREAD_BLOCKED) {
-        scheduler_schedule();
-    }
-    
-    mutex->locked = 1;
-    mutex->owner = running_thread;
-    
-    unblock_signals();
-    return 0;
-}
-
-int uthread_mutex_unlock(mutex_t *mutex) {
-    block_signals();
-
-    if (mutex == NULL || running_thread == NULL) {
+    if (new_thread == NULL) {
         unblock_signals();
         return -1;
     }
     
-    if (mutex->owner != running_thread) {
+    // Allocate stack; arena slots have a fixed size
+    size_t stack_size = STACK_SIZE;
+    if (new_thread->cold->stack_source != STACK_ARENA) {
+        stack_size = stack_size_for(start_routine);
+        // A learned size can be too small to hold the argument as well
+        if (construct != NULL && arg_size > stack_size / 2) {
+            stack_size = STACK_SIZE;
+        }
+    }
+    new_thread->cold->stack = stack_alloc(new_thread->cold, stack_size);
+    if (new_thread->cold->stack == NULL) {
         unblock_signals();
         return -1;
     }
+    new_thread->cold->stack_size = stack_size;
+    stack_paint(new_thread->cold, stack_policy != UTHREAD_STACK_FIXED);
+
+    new_thread->cold->fp_area = NULL;
+#ifdef UTHREAD_FAST_SWITCH
+    if (attr->fp_state == UTHREAD_FP_FULL) {
+        new_thread->cold->fp_area = aligned_alloc(16, FP_AREA_SIZE);
+        if (new_thread->cold->fp_area == NULL) {
+            stack_free(new_thread->cold);
+            unblock_signals();
+            return -1;
+        }
+    }
+#endif
+
+    // Built once nothing below can fail: only the thread itself ever
+    // destroys its argument
+    size_t usable = stack_size;
+    if (construct != NULL) {
+        usable -= (arg_size + 15) & ~(size_t)15;
+        arg = (char *)new_thread->cold->stack + usable;
+        construct(arg, ctx);
+    }
     
-    mutex->locked = 0;
-    mutex->owner = NULL;
+    new_thread->tid = next_tid++;
+    new_thread->state = THREAD_READY;
+    new_thread->kind = THREAD_KIND_STACKFUL;
+    new_thread->cold->retval = NULL;
+    new_thread->cold->start_routine = start_routine;
+    new_thread->cold->arg = arg;
+    new_thread->next = NULL;
+    new_thread->waiting_for = NULL;
+    new_thread->blocked_on = NULL;
+    new_thread->blocked_on_rw = NULL;
+    new_thread->blocked_on_future = NULL;
+    new_thread->is_writer = false;
+    new_thread->group = attr->group;
+    memset(new_thread->cold->read_holds, 0, sizeof(new_thread->cold->read_holds));
+#ifdef UTHREAD_LOCKDEP
+    new_thread->cold->held.count = 0;
+#endif
+    new_thread->cold->tls_used = false;
+    memset(new_thread->cold->tls_inline, 0, sizeof(new_thread->cold->tls_inline));
+    new_thread->cold->tls_overflow = NULL;
+    new_thread->cold->rcu_nesting = 0;
+    new_thread->cold->rcu_qs = rcu_gp_seq;
+    
+    new_thread->cold->has_sigmask = attr->has_sigmask;
+    new_thread->cold->sigmask = attr->has_sigmask ? attr->sigmask : default_sigmask;
+
+    ctx_make(&new_thread->cold->context, new_thread->cold->stack, usable,
+             thread_wrapper, &new_thread->cold->sigmask);
     
-    if (mutex->waiting_list != NULL) {
-        thread_t *next = mutex->waiting_list;
-        mutex->waiting_list = next->next;
-        unblock_thread(next);
-    }
+    enqueue_thread(new_thread);
+    thread_count++;
+    group->live++;
     
     unblock_signals();
-    return 0;
+    return new_thread->tid;
 }
 
-static void safe_print_str(const char *s) {
-    write(STDOUT_FILENO, s, strlen(s));
-}
+static void thread_wrapper(void) {
+    // Switched to with the timer masked, like every other resumed path
+    unblock_signals();
 
-static void safe_print_int(int n) {
-    char buffer[32];
-    int i = 0;
-    if (n == 0) {
-        buffer[i++] = '0';
-    } else {
-        if (n < 0) {
-            safe_print_str("-");
-            n = -n;
-        }
-        int temp = n;
-        int len = 0;
-        int temp_len = n;
-        while (temp_len > 0) {
-            temp_len /= 10;
-            len++;
-        }
-        
-        i = len;
-        while (temp > 0) {
-            buffer[--len] = '0' + (temp % 10);
-            temp /= 10;
-        }
+    thread_cold_t *cold = running_thread ? running_thread->cold : NULL;
+    if (cold && cold->start_routine) {
+        cold->start_routine(cold->arg);
     }
-    write(STDOUT_FILENO, buffer, i);
+    uthread_exit(NULL);
 }
 
-static void print_deadlock_report(void) {
-    
-    safe_print_str("Deadlock report:\n");
 
-    bool has_deadlock = false;
+void scheduler_yield(void) {
+    // Tasks are only suspended at their own UTHREAD_TASK_* points
+    if (running_thread == NULL || running_thread->kind == THREAD_KIND_TASK) return;
+
+    // Callers other than timer_handler() arrive with the timer unmasked;
+    // a tick mid-switch would save this context into the next thread
+    sigset_t set, old_set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGALRM);
+    sigprocmask(SIG_BLOCK, &set, &old_set);
     
-    // Check for cycles in mutex waiting
-    for (int i = 0; i < MAX_THREADS; i++) { // Check all slots
-        thread_t *t = &threads[i];
-        if (t->tid != 0 && t->state == THREAD_BLOCKED && t->blocked_on != NULL) {
-            thread_t *start = t;
-            thread_t *current = start;
-            int depth = 0;
-            bool cycle = false;
-            
-            // Follow the chain
-            while (current && current->blocked_on && depth < MAX_THREADS) {
-                mutex_t *mutex = current->blocked_on;
-                if (mutex->owner == NULL) {
-                    break;
-                }
-                if (mutex->owner == start) {
-                    cycle = true;
-                    break;
-                }
-                current = mutex->owner;
-                depth++;
-            }
-            
-            if (cycle) {
-                if (!has_deadlock) {
-                    // Only print header once
-                    has_deadlock = true;
-                }
-                safe_print_str("Deadlock detected! Cycle involving thread ");
-                safe_print_int(start->tid);
-                safe_print_str("\n");
-                
-                current = start;
-                safe_print_str("  Thread ");
-                safe_print_int(current->tid);
-                safe_print_str(" -> ");
-                
-                depth = 0;
-                do {
-                    if (current->blocked_on && current->blocked_on->owner) {
-                        safe_print_str("Thread ");
-                        safe_print_int(current->blocked_on->owner->tid);
-                        safe_print_str(" -> ");
-                        current = current->blocked_on->owner;
-                    } else {
-                        break;
-                    }
-                } while (current != start && depth++ < MAX_THREADS);
-                safe_print_str("Thread ");
-                safe_print_int(start->tid);
-                safe_print_str("\n");
-                
-                break; 
-            }
-        }
+    if (running_thread->state == THREAD_RUNNING) {
+        running_thread->state = THREAD_READY;
+        enqueue_thread(running_thread);
+        scheduler_schedule();
     }
-    
-    if (!has_deadlock) {
-        safe_print_str("No deadlock detected.\n");
+
+    sigprocmask(SIG_SETMASK, &old_set, NULL);
+}
+
+// Frees the stack of the last terminated thread, which cannot free it
+// itself while still running on it
+static void reap_thread_to_free(void) {
+    if (thread_to_free != NULL) {
+        if (thread_to_free->cold->stack) {
+            stack_check(thread_to_free);
+            stack_record(thread_to_free->cold);
+            stack_free(thread_to_free->cold);
+        }
+        free(thread_to_free->cold->fp_area);
+        thread_to_free->cold->fp_area = NULL;
+        thread_to_free = NULL;
     }
 }
 
-int uthread_rwlock_init(rwlock_t *rwlock) {
-    if (rwlock == NULL) {
-        return -1;
+// Picks the next thread to run. With main blocked as well, every thread is
+// waiting and only a timed wait can end that, so sleeps until the earliest
+// deadline expires and looks again.
+static thread_t *next_runnable(void) {
+    thread_t *next = dequeue_thread();
+    while (next == NULL && threads[0].state == THREAD_BLOCKED && wait_idle() == 0) {
+        next = dequeue_thread();
     }
-    rwlock->readers = 0;
-    rwlock->writer = NULL;
-    rwlock->read_waiting = NULL;
-    rwlock->write_waiting = NULL;
-    rwlock->readers_list = NULL;
-    return 0;
+    if (next != NULL) {
+        return next;
+    }
+
+    // No thread can ever run again. Main may only be resumed from
+    // uthread_wait(), which reports EDEADLK; anywhere else it would take
+    // being switched to for a wakeup.
+    if (threads[0].state == THREAD_BLOCKED && !wait_queued(&threads[0])) {
+        safe_print_str("All threads are blocked\n");
+        print_deadlock_report();
+        abort();
+    }
+    return &threads[0];
 }
 
-int uthread_rwlock_rdlock(rwlock_t *rwlock) {
-    block_signals();
+void scheduler_schedule(void) {
+    // Free pending stack from previous terminated thread
+    reap_thread_to_free();
 
-    if (rwlock == NULL || running_thread == NULL) {
-        unblock_signals();
-        return -1;
+    // Switching out of a thread outside any RCU read-side section
+    if (running_thread && running_thread->cold &&
+        running_thread->cold->rcu_nesting == 0) {
+        running_thread->cold->rcu_qs = rcu_gp_seq;
     }
-    
-    // If no writer and no writers waiting, allow read
-    if (rwlock->writer == NULL && rwlock->write_waiting == NULL) {
-        rwlock->readers++;
-        if (rwlock->readers_list == NULL) {
-            rwlock->readers_list = running_thread;
-            running_thread->next = NULL;
-        } else {
-            thread_t *current = rwlock->readers_list;
-            while (current->next != NULL) {
-                current = current->next;
-            }
-            current->next = running_thread;
-            running_thread->next = NULL;
-        }
-        unblock_signals();
-        return 0;
+
+    if (group_count > 1) {
+        group_charge();
     }
+
+    thread_t *next = next_runnable();
     
-    running_thread->state = THREAD_BLOCKED;
-    running_thread->blocked_on_rw = rwlock;
-    running_thread->is_writer = false;
-    
-    // Add to read waiting list
-    if (rwlock->read_waiting == NULL) {
-        rwlock->read_waiting = running_thread;
-        running_thread->next = NULL;
-    } else {
-        thread_t *current = rwlock->read_waiting;
-        while (current->next != NULL) {
-            current = current->next;
-        }
-        current->next = running_thread;
-        running_thread->next = NULL;
+    thread_t *prev = running_thread;
+    running_thread = next;
+    running_thread->state = THREAD_RUNNING;
+
+    // A yield with nothing else ready dequeues the caller itself
+    if (next == prev) {
+        return;
     }
     
-    // Context switch
-    thread_t *prev = running_thread;
-    if (prev->tid == 0) {
-        getcontext(&main_context);
+    uthread_ctx_t *next_ctx;
+    if (running_thread->kind == THREAD_KIND_TASK) {
+        next_ctx = carrier_prepare(running_thread);
     } else {
-        getcontext(&prev->context);
+        next_ctx = &running_thread->cold->context;
     }
-    
-    if (running_thread->state == THREAD_BLOCKED) {
-        scheduler_schedule();
+
+    if (prev && prev->cold && prev->cold->stack) {
+        stack_check(prev);
     }
-    
-    // When we resume, we should have the read lock
-    rwlock->readers++;
-    if (rwlock->readers_list == NULL) {
-        rwlock->readers_list = running_thread;
-        running_thread->next = NULL;
+    sigmask_switch(running_thread);
+    stats_switches++;
+    if (prev && prev->state == THREAD_TERMINATED) {
+        thread_to_free = prev;
+        ctx_jump(next_ctx);
     } else {
-        thread_t *current = rwlock->readers_list;
-        while (current->next != NULL) {
-            current = current->next;
-        }
-        current->next = running_thread;
-        running_thread->next = NULL;
+        ctx_switch(prev ? prev : &threads[0], next_ctx);
     }
-    
-    unblock_signals();
-    return 0;
 }
 
-int uthread_rwlock_wrlock(rwlock_t *rwlock) {
-    block_signals();
-
-    if (rwlock == NULL || running_thread == NULL) {
-        unblock_signals();
-        return -1;
-    }
-    
-    // If no readers and no writer, allow write
-    if (rwlock->readers == 0 && rwlock->writer == NULL) {
-        rwlock->writer = running_thread;
-        unblock_signals();
+int uthread_self(void) {
+    if (running_thread == NULL) {
         return 0;
     }
+    return running_thread->tid;
+}
+
+void uthread_exit(void *retval) {
+    // Destructors are user code, so run them before masking preemption
+    if (running_thread != NULL && running_thread->tid != 0 &&
+        running_thread->cold->tls_used) {
+        tls_run_destructors(running_thread);
+    }
+
+    block_signals();
+
+    if (running_thread == NULL || running_thread->tid == 0) {
+        exit(0);
+    }
     
-    // Block and wait
-    running_thread->state = THREAD_BLOCKED;
-    running_thread->blocked_on_rw = rwlock;
-    running_thread->is_writer = true;
+    running_thread->cold->retval = retval;
+    running_thread->state = THREAD_TERMINATED;
     
-    // Add to write waiting list
-    if (rwlock->write_waiting == NULL) {
-        rwlock->write_waiting = running_thread;
-        running_thread->next = NULL;
-    } else {
-        thread_t *current = rwlock->write_waiting;
-        while (current->next != NULL) {
-            current = current->next;
+    for (int i = 0; i < MAX_THREADS; i++) {
+        if (threads[i].state != THREAD_TERMINATED && threads[i].waiting_for == running_thread) {
+            unblock_thread(&threads[i]);
         }
-        current->next = running_thread;
-        running_thread->next = NULL;
     }
     
-    // Context switch
-    thread_t *prev = running_thread;
-    if (prev->tid == 0) {
-        getcontext(&main_context);
-    } else {
-        getcontext(&prev->context);
+    thread_count--;
+    groups[running_thread->group].live--;
+    
+    scheduler_schedule();
+    exit(1);
+}
+
+int uthread_join(int tid, void **retval) {
+    block_signals();
+
+    thread_t *target = find_thread(tid);
+    
+    if (target == NULL || running_thread->kind == THREAD_KIND_TASK) {
+        unblock_signals();
+        return -1;
     }
     
-    if (running_thread->state == THREAD_BLOCKED) {
-        scheduler_schedule();
+    if (target->state == THREAD_TERMINATED) {
+        if (retval) {
+            *retval = target->cold->retval;
+        }
+        unblock_signals();
+        return 0;
+    }
+    
+    running_thread->waiting_for = target;
+    if (wfg_check_block(running_thread) != 0) {
+        running_thread->waiting_for = NULL;
+        unblock_signals();
+        errno = EDEADLK;
+        return -1;
     }
+    running_thread->state = THREAD_BLOCKED;
+    scheduler_schedule();
     
-    // When we resume, we should have the write lock
-    rwlock->writer = running_thread;
+    if (retval) {
+        *retval = target->cold->retval;
+    }
     
     unblock_signals();
     return 0;
 }
 
-// Read-write lock unlock
-int uthread_rwlock_unlock(rwlock_t *rwlock) {
+// Stackless tasks
+//
+// A task is a thread_t header plus its step function, so it sits on
+// the same ready queue and wait lists as stackful threads and is woken by
+// unblock_thread(). When the scheduler dequeues a task it switches to the
+// carrier context, which runs that task and every task queued behind it
+// as plain function calls, and only switches context again for the next
+// stackful thread. Preemption stays masked on the carrier.
+
+static void carrier_loop(void) {
+    thread_t *next = carrier_first;
+
+    while (next != NULL && next->kind == THREAD_KIND_TASK) {
+        running_thread = next;
+        next->state = THREAD_RUNNING;
+
+        uthread_task_t *task = (uthread_task_t *)next;
+        switch (task->fn(task, task->arg)) {
+        case UTHREAD_TASK_YIELDED:
+            next->state = THREAD_READY;
+            enqueue_thread(next);
+            break;
+        case UTHREAD_TASK_BLOCKED:
+            // uthread_task_mutex_lock() already queued it on a wait list
+            break;
+        default:
+            next->state = THREAD_TERMINATED;
+#ifdef UTHREAD_LOCKDEP
+            free(task->held);
+#endif
+            free(next);
+            break;
+        }
+
+        next = next_runnable();
+    }
+
+    // Tasks may have unmasked the timer (e.g. via uthread_mutex_unlock),
+    // so mask it again before running_thread names a stackful thread
     block_signals();
+    carrier_active = 0;
 
-    if (rwlock == NULL || running_thread == NULL) {
+    running_thread = next;
+    running_thread->state = THREAD_RUNNING;
+    sigmask_switch(next);
+    ctx_jump(&next->cold->context);
+}
+
+static uthread_ctx_t *carrier_prepare(thread_t *task) {
+    if (carrier_stack == NULL) {
+        carrier_stack = malloc(CARRIER_STACK_SIZE);
+        if (carrier_stack == NULL) {
+            abort();
+        }
+    }
+
+    carrier_first = task;
+    carrier_active = 1;
+    ctx_make(&carrier_context, carrier_stack, CARRIER_STACK_SIZE, carrier_loop,
+             &default_sigmask);
+    return &carrier_context;
+}
+
+int uthread_task_create(int (*fn)(uthread_task_t *task, void *arg), void *arg) {
+    if (fn == NULL) {
+        return -1;
+    }
+
+    block_signals();
+
+    if (!scheduler_initialized) {
+        scheduler_init();
+    }
+
+    uthread_task_t *task = calloc(1, sizeof(*task));
+    if (task == NULL) {
         unblock_signals();
         return -1;
     }
-    
-    if (rwlock->writer == running_thread) {
-        // Unlocking write lock
-        rwlock->writer = NULL;
-        
-        // Unblock waiting readers (all of them can proceed)
-        while (rwlock->read_waiting != NULL) {
-            thread_t *next = rwlock->read_waiting;
-            rwlock->read_waiting = next->next;
-            unblock_thread(next);
+
+    task->thread.tid = next_tid++;
+    task->thread.state = THREAD_READY;
+    task->thread.kind = THREAD_KIND_TASK;
+    task->fn = fn;
+    task->arg = arg;
+
+    enqueue_thread(&task->thread);
+
+    unblock_signals();
+    return task->thread.tid;
+}
+
+// Returns 0 when the mutex was taken, 1 when the task has been parked on
+// the mutex (ownership is handed over before it is resumed), -1 on error
+int uthread_task_mutex_lock(uthread_task_t *task, mutex_t *mutex) {
+    thread_t *self = task ? &task->thread : NULL;
+    if (self == NULL || mutex == NULL || self != running_thread) {
+        return -1;
+    }
+
+    LOCKDEP_CHECK(mutex->lock_class);
+
+    if (mutex->locked == 0) {
+        mutex->locked = 1;
+        mutex->owner = self;
+        LOCKDEP_PUSH(mutex->lock_class, mutex);
+        return 0;
+    }
+
+    if (mutex->owner == self) {
+        errno = EDEADLK;
+        return -1;
+    }
+
+    self->blocked_on = mutex;
+    if (wfg_check_block(self) != 0) {
+        self->blocked_on = NULL;
+        errno = EDEADLK;
+        return -1;
+    }
+    self->state = THREAD_BLOCKED;
+
+    if (mutex->waiting_list == NULL) {
+        mutex->waiting_list = self;
+    } else {
+        thread_t *current = mutex->waiting_list;
+        while (current->next != NULL) {
+            current = current->next;
         }
-        
-        // If no readers waiting, unblock first writer
-        if (rwlock->read_waiting == NULL && rwlock->write_waiting != NULL) {
-            thread_t *next = rwlock->write_waiting;
-            rwlock->write_waiting = next->next;
-            unblock_thread(next);
+        current->next = self;
+    }
+    self->next = NULL;
+
+#ifdef UTHREAD_LOCKDEP
+    // Recorded now since the resume point skips this call
+    lockdep_push(mutex->lock_class, mutex);
+#endif
+    return 1;
+}
+
+// Data-parallel layer
+//
+// parallel_for and graph runs are executed by the caller plus up to
+// PARALLEL_HELPERS stackless tasks, so they never consume thread slots
+// however many chunks or nodes there are. Helpers yield between chunks
+// since the timer cannot preempt them. The caller waits on a promise the
+// last helper sets.
+
+typedef struct pfor_job {
+    void (*fn)(size_t begin, size_t end, void *ctx);
+    void *ctx;
+    size_t grain;
+    size_t ranges[PARALLEL_HELPERS][2]; // Subranges nobody has claimed yet
+    int nranges;
+    int active;                 // Helper tasks still running
+    uthread_future_t *done;     // Set by the last helper to leave
+} pfor_job_t;
+
+typedef struct pfor_helper {
+    pfor_job_t *job;
+    size_t begin;               // Range this helper currently owns
+    size_t end;
+} pfor_helper_t;
+
+// Claims the next grain of [*begin, *end), taking a new range from the
+// pool if needed. While the pool holds fewer ranges than there are
+// helpers, the rest of a large range is split in half and the upper half
+// offered, so ranges are only cut as fast as executors run dry.
+// Returns false when there is no work left.
+static bool pfor_claim(pfor_job_t *job, size_t *begin, size_t *end, size_t *stop) {
+    if (*begin >= *end) {
+        if (job->nranges == 0) {
+            return false;
         }
-    } else {
-        // Check if thread is a reader
-        thread_t *reader = rwlock->readers_list;
-        thread_t *prev_reader = NULL;
-        bool is_reader = false;
-        
-        while (reader != NULL) {
-            if (reader == running_thread) {
-                is_reader = true;
-                // Remove from readers list
-                if (prev_reader == NULL) {
-                    rwlock->readers_list = reader->next;
-                } else {
-                    prev_reader->next = reader->next;
-                }
-                reader->next = NULL;
-                break;
-            }
-            prev_reader = reader;
-            reader = reader->next;
+        job->nranges--;
+        *begin = job->ranges[job->nranges][0];
+        *end = job->ranges[job->nranges][1];
+    }
+
+    *stop = *end - *begin > job->grain ? *begin + job->grain : *end;
+    if (job->nranges < PARALLEL_HELPERS && *end - *stop > job->grain) {
+        size_t mid = *stop + (*end - *stop) / 2;
+        job->ranges[job->nranges][0] = mid;
+        job->ranges[job->nranges][1] = *end;
+        job->nranges++;
+        *end = mid;
+    }
+    return true;
+}
+
+static void parallel_helper_done(int *active, uthread_future_t *done) {
+    if (--*active == 0) {
+        uthread_promise_set(done, NULL);
+    }
+}
+
+static int pfor_helper_step(uthread_task_t *task, void *arg) {
+    pfor_helper_t *helper = arg;
+    size_t stop;
+
+    UTHREAD_TASK_BEGIN(task);
+    while (pfor_claim(helper->job, &helper->begin, &helper->end, &stop)) {
+        helper->job->fn(helper->begin, stop, helper->job->ctx);
+        helper->begin = stop;
+        UTHREAD_TASK_YIELD(task);
+    }
+    parallel_helper_done(&helper->job->active, helper->job->done);
+    UTHREAD_TASK_END(task);
+}
+
+int uthread_parallel_for(size_t begin, size_t end, size_t grain,
+                         void (*fn)(size_t begin, size_t end, void *ctx), void *ctx) {
+    if (fn == NULL || begin > end ||
+        (running_thread && running_thread->kind == THREAD_KIND_TASK)) {
+        return -1;
+    }
+    if (begin == end) {
+        return 0;
+    }
+
+    size_t n = end - begin;
+    if (grain == 0) {
+        grain = n / (8 * (PARALLEL_HELPERS + 1));
+        if (grain == 0) {
+            grain = 1;
         }
-        
-        if (is_reader) {
-            // Unlocking read lock
-            rwlock->readers--;
-            
-            // If last reader, unblock waiting writers
-            if (rwlock->readers == 0 && rwlock->write_waiting != NULL) {
-                thread_t *next = rwlock->write_waiting;
-                rwlock->write_waiting = next->next;
-                unblock_thread(next);
-            }
-        } else {
-            unblock_signals();
-            return -1; 
+    }
+
+    pfor_job_t job;
+    job.fn = fn;
+    job.ctx = ctx;
+    job.grain = grain;
+    job.ranges[0][0] = begin;
+    job.ranges[0][1] = end;
+    job.nranges = 1;
+    job.active = 0;
+    job.done = NULL;
+
+    size_t chunks = (n + grain - 1) / grain;
+    int helpers = chunks - 1 < PARALLEL_HELPERS ? (int)(chunks - 1) : PARALLEL_HELPERS;
+    pfor_helper_t helper_state[PARALLEL_HELPERS];
+
+    if (helpers > 0) {
+        job.done = uthread_promise_create();
+        if (job.done == NULL) {
+            helpers = 0;
+        }
+    }
+
+    block_signals();
+    for (int i = 0; i < helpers; i++) {
+        helper_state[i].job = &job;
+        helper_state[i].begin = 0;
+        helper_state[i].end = 0;
+        job.active++;
+        if (uthread_task_create(pfor_helper_step, &helper_state[i]) < 0) {
+            job.active--;
         }
     }
-    
     unblock_signals();
+
+    // The caller works through the range too
+    size_t my_begin = 0, my_end = 0, stop;
+    for (;;) {
+        block_signals();
+        bool more = pfor_claim(&job, &my_begin, &my_end, &stop);
+        unblock_signals();
+        if (!more) {
+            break;
+        }
+        fn(my_begin, stop, ctx);
+        my_begin = stop;
+    }
+
+    if (job.done != NULL) {
+        block_signals();
+        bool wait = job.active > 0;
+        unblock_signals();
+        if (wait) {
+            uthread_await(job.done, NULL);
+        }
+        uthread_future_release(job.done);
+    }
     return 0;
 }
 
-int uthread_rwlock_destroy(rwlock_t *rwlock) {
-    if (rwlock == NULL) {
+typedef struct graph_node {
+    void (*fn)(void *);
+    void *arg;
+    int *succ;                  // Nodes that depend on this one
+    int nsucc;
+    int succ_cap;
+    int npred;                  // Number of dependencies
+    int pending;                // Dependencies not yet finished in this run
+} graph_node_t;
+
+struct uthread_graph {
+    graph_node_t *nodes;
+    int count;
+    int cap;
+    int *ready;                 // Stack of runnable nodes
+    int nready;
+    int active;                 // Helper tasks still running
+    uthread_future_t *done;     // Set by the last helper to leave
+};
+
+uthread_graph_t *uthread_graph_create(void) {
+    block_signals();
+    uthread_graph_t *graph = calloc(1, sizeof(uthread_graph_t));
+    unblock_signals();
+    return graph;
+}
+
+int uthread_graph_add(uthread_graph_t *graph, void (*fn)(void *), void *arg) {
+    if (graph == NULL || fn == NULL) {
         return -1;
     }
-    
-    if (rwlock->readers > 0 || rwlock->writer != NULL) {
-        return -1; // Lock is still in use
+
+    if (graph->count == graph->cap) {
+        int cap = graph->cap ? graph->cap * 2 : 16;
+        block_signals();
+        graph_node_t *nodes = realloc(graph->nodes, cap * sizeof(graph_node_t));
+        unblock_signals();
+        if (nodes == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        graph->nodes = nodes;
+        graph->cap = cap;
     }
-    rwlock->readers = 0;
-    rwlock->writer = NULL;
-    rwlock->read_waiting = NULL;
-    rwlock->write_waiting = NULL;
-    rwlock->readers_list = NULL;
-    
+
+    graph_node_t *node = &graph->nodes[graph->count];
+    memset(node, 0, sizeof(graph_node_t));
+    node->fn = fn;
+    node->arg = arg;
+    return graph->count++;
+}
+
+// `node` runs only after `before` has finished
+int uthread_graph_depend(uthread_graph_t *graph, int node, int before) {
+    if (graph == NULL || node < 0 || node >= graph->count ||
+        before < 0 || before >= graph->count || node == before) {
+        return -1;
+    }
+
+    graph_node_t *pred = &graph->nodes[before];
+    if (pred->nsucc == pred->succ_cap) {
+        int cap = pred->succ_cap ? pred->succ_cap * 2 : 4;
+        block_signals();
+        int *succ = realloc(pred->succ, cap * sizeof(int));
+        unblock_signals();
+        if (succ == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        pred->succ = succ;
+        pred->succ_cap = cap;
+    }
+    pred->succ[pred->nsucc++] = node;
+    graph->nodes[node].npred++;
     return 0;
 }
 
-void deadlock_detect(void) {
-    print_deadlock_report();
-}
\ No newline at end of file
+// Marks `node` finished and makes successors runnable
+static void graph_finish(uthread_graph_t *graph, int node) {
+    graph_node_t *done = &graph->nodes[node];
+    for (int i = 0; i < done->nsucc; i++) {
+        if (--graph->nodes[done->succ[i]].pending == 0) {
+            graph->ready[graph->nready++] = done->succ[i];
+        }
+    }
+}
+
+static int graph_helper_step(uthread_task_t *task, void *arg) {
+    uthread_graph_t *graph = arg;
+
+    UTHREAD_TASK_BEGIN(task);
+    while (graph->nready > 0) {
+        int node = graph->ready[--graph->nready];
+        graph->nodes[node].fn(graph->nodes[node].arg);
+        graph_finish(graph, node);
+        UTHREAD_TASK_YIELD(task);
+    }
+    parallel_helper_done(&graph->active, graph->done);
+    UTHREAD_TASK_END(task);
+}
+
+// Runs every node once, each after all of its dependencies. Returns -1
+// with errno EINVAL without running anything if the graph has a cycle.
+int uthread_graph_run(uthread_graph_t *graph) {
+    if (graph == NULL || (running_thread && running_thread->kind == THREAD_KIND_TASK)) {
+        return -1;
+    }
+    if (graph->count == 0) {
+        return 0;
+    }
+
+    block_signals();
+    free(graph->ready);
+    graph->ready = malloc(graph->count * sizeof(int));
+    unblock_signals();
+    if (graph->ready == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    // Kahn's algorithm once up front, so a cycle fails before any node runs
+    int visited = 0;
+    graph->nready = 0;
+    for (int i = 0; i < graph->count; i++) {
+        graph->nodes[i].pending = graph->nodes[i].npred;
+        if (graph->nodes[i].pending == 0) {
+            graph->ready[graph->nready++] = i;
+        }
+    }
+    while (graph->nready > 0) {
+        graph_finish(graph, graph->ready[--graph->nready]);
+        visited++;
+    }
+    if (visited != graph->count) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (int i = 0; i < graph->count; i++) {
+        graph->nodes[i].pending = graph->nodes[i].npred;
+        if (graph->nodes[i].pending == 0) {
+            graph->ready[graph->nready++] = i;
+        }
+    }
+
+    int helpers = graph->count - 1 < PARALLEL_HELPERS ? graph->count - 1 : PARALLEL_HELPERS;
+    graph->active = 0;
+    graph->done = helpers > 0 ? uthread_promise_create() : NULL;
+
+    block_signals();
+    for (int i = 0; i < helpers && graph->done != NULL; i++) {
+        graph->active++;
+        if (uthread_task_create(graph_helper_step, graph) < 0) {
+            graph->active--;
+        }
+    }
+    unblock_signals();
+
+    // The caller runs nodes too. Helpers finish a node before they can be
+    // switched out, so an empty ready stack here means every node ran.
+    for (;;) {
+        block_signals();
+        if (graph->nready == 0) {
+            unblock_signals();
+            break;
+        }
+        int node = graph->ready[--graph->nready];
+        unblock_signals();
+
+        graph->nodes[node].fn(graph->nodes[node].arg);
+
+        block_signals();
+        graph_finish(graph, node);
+        unblock_signals();
+    }
+
+    if (graph->done != NULL) {
+        block_signals();
+        bool wait = graph->active > 0;
+        unblock_signals();
+        if (wait) {
+            uthread_await(graph->done, NULL);
+        }
+        uthread_future_release(graph->done);
+        graph->done = NULL;
+    }
+    return 0;
+}
+
+void uthread_graph_destroy(uthread_graph_t *graph) {
+    if (graph == NULL) {
+        return;
+    }
+    block_signals();
+    for (int i = 0; i < graph->count; i++) {
+        free(graph->nodes[i].succ);
+    }
+    free(graph->nodes);
+    free(graph->ready);
+    free(graph);
+    unblock_signals();
+}
+
+// Futures
+//
+// Completion walks the future's own waiter list, so awaiting never scans
+// the thread table the way uthread_join() does. Combinators register a
+// link on each input and complete from the last (when_all) or first
+// (when_any) input's completion. All of this runs with preemption masked.
+
+static uthread_future_t *future_alloc(void) {
+    uthread_future_t *future = calloc(1, sizeof(uthread_future_t));
+    if (future != NULL) {
+        future->refs = 1;
+    }
+    return future;
+}
+
+static void future_put(uthread_future_t *future) {
+    if (--future->refs == 0) {
+        free(future->links);
+        free(future);
+    }
+}
+
+static void future_complete(uthread_future_t *future, void *value);
+
+// An input of a combinator has completed
+static void future_notify(future_waiter_t *link) {
+    uthread_future_t *combinator = link->combinator;
+    uthread_future_t *source = link->source;
+
+    if (combinator->any) {
+        if (!combinator->ready) {
+            future_complete(combinator, source);
+        }
+    } else if (combinator->pending == 1) {
+        future_complete(combinator, NULL);
+    }
+
+    if (--combinator->pending == 0) {
+        future_put(combinator); // Reference held for the links
+    }
+    future_put(source);
+}
+
+static void future_complete(uthread_future_t *future, void *value) {
+    future->value = value;
+    future->ready = true;
+    future->producer = NULL;
+
+    future_waiter_t *waiter = future->waiters;
+    future->waiters = NULL;
+    while (waiter != NULL) {
+        future_waiter_t *next = waiter->next;
+        if (waiter->thread != NULL) {
+            unblock_thread(waiter->thread);
+        } else {
+            future_notify(waiter);
+        }
+        waiter = next;
+    }
+}
+
+static void future_thread_main(void *arg) {
+    uthread_future_t *future = arg;
+
+    block_signals();
+    future->producer = running_thread;
+    unblock_signals();
+
+    void *value = future->fn(future->arg);
+
+    block_signals();
+    future_complete(future, value);
+    future_put(future);
+    unblock_signals();
+
+    uthread_exit(value);
+}
+
+uthread_future_t *uthread_async(void *(*fn)(void *), void *arg) {
+    if (fn == NULL) {
+        return NULL;
+    }
+
+    block_signals();
+    uthread_future_t *future = future_alloc();
+    unblock_signals();
+    if (future == NULL) {
+        return NULL;
+    }
+    future->fn = fn;
+    future->arg = arg;
+    future->refs = 2; // Caller + producing uthread
+
+    if (uthread_create(future_thread_main, future) < 0) {
+        block_signals();
+        free(future);
+        unblock_signals();
+        return NULL;
+    }
+    return future;
+}
+
+uthread_future_t *uthread_promise_create(void) {
+    block_signals();
+    uthread_future_t *future = future_alloc();
+    unblock_signals();
+    return future;
+}
+
+int uthread_promise_set(uthread_future_t *future, void *value) {
+    block_signals();
+    if (future == NULL || future->ready) {
+        unblock_signals();
+        return -1;
+    }
+    future_complete(future, value);
+    unblock_signals();
+    return 0;
+}
+
+int uthread_await(uthread_future_t *future, void **value) {
+    block_signals();
+
+    if (!scheduler_initialized) {
+        scheduler_init();
+    }
+
+    if (future == NULL || running_thread->kind == THREAD_KIND_TASK) {
+        unblock_signals();
+        return -1;
+    }
+
+    if (!future->ready) {
+        future_waiter_t waiter = { running_thread, NULL, NULL, future->waiters };
+        future->waiters = &waiter;
+        running_thread->blocked_on_future = future;
+        if (wfg_check_block(running_thread) != 0) {
+            future->waiters = waiter.next;
+            running_thread->blocked_on_future = NULL;
+            unblock_signals();
+            errno = EDEADLK;
+            return -1;
+        }
+        running_thread->state = THREAD_BLOCKED;
+        scheduler_schedule();
+    }
+
+    if (value) {
+        *value = future->value;
+    }
+    unblock_signals();
+    return 0;
+}
+
+bool uthread_future_ready(const uthread_future_t *future) {
+    return future != NULL && future->ready;
+}
+
+static uthread_future_t *future_combine(uthread_future_t **futures, int count, bool any) {
+    if (count < 0 || (count > 0 && futures == NULL)) {
+        return NULL;
+    }
+
+    block_signals();
+    uthread_future_t *combinator = future_alloc();
+    if (combinator != NULL && count > 0) {
+        combinator->links = calloc(count, sizeof(future_waiter_t));
+        if (combinator->links == NULL) {
+            free(combinator);
+            combinator = NULL;
+        }
+    }
+    if (combinator == NULL) {
+        unblock_signals();
+        return NULL;
+    }
+
+    combinator->any = any;
+    combinator->pending = count;
+    if (count == 0) {
+        future_complete(combinator, NULL);
+        unblock_signals();
+        return combinator;
+    }
+
+    combinator->refs++; // Dropped once every input has reported
+    for (int i = 0; i < count; i++) {
+        future_waiter_t *link = &combinator->links[i];
+        link->combinator = combinator;
+        link->source = futures[i];
+        futures[i]->refs++;
+        if (futures[i]->ready) {
+            future_notify(link);
+        } else {
+            link->next = futures[i]->waiters;
+            futures[i]->waiters = link;
+        }
+    }
+
+    unblock_signals();
+    return combinator;
+}
+
+// Completes once every input has a value; its own value is NULL
+uthread_future_t *uthread_when_all(uthread_future_t **futures, int count) {
+    return future_combine(futures, count, false);
+}
+
+// Completes with the first input future that gets a value
+uthread_future_t *uthread_when_any(uthread_future_t **futures, int count) {
+    return future_combine(futures, count, true);
+}
+
+void uthread_future_release(uthread_future_t *future) {
+    if (future == NULL) {
+        return;
+    }
+    block_signals();
+    future_put(future);
+    unblock_signals();
+}
+
+// Read-copy-update
+//
+// A thread passing through scheduler_schedule() outside a read-side
+// section is in a quiescent state, so readers only bump a counter in
+// their own descriptor. A grace period has elapsed once every thread
+// that was inside a read-side section when it started has either left
+// it (its nesting is zero while it is switched out) or been switched out
+// outside one since; uthread_synchronize_rcu() yields until then.
+// Callbacks queued by uthread_call_rcu() are run by a reclaimer uthread,
+// created on first use, after a grace period per batch.
+
+void uthread_rcu_read_lock(void) {
+    thread_t *self = running_thread;
+    if (self != NULL && self->cold != NULL) {
+        self->cold->rcu_nesting++;
+    }
+}
+
+void uthread_rcu_read_unlock(void) {
+    thread_t *self = running_thread;
+    if (self != NULL && self->cold != NULL) {
+        self->cold->rcu_nesting--;
+    }
+}
+
+static bool rcu_gp_done(unsigned long gp) {
+    for (int i = 0; i < MAX_THREADS; i++) {
+        thread_t *t = &threads[i];
+        if ((i != 0 && t->tid == 0) || t->state == THREAD_TERMINATED ||
+            t == running_thread) {
+            continue;
+        }
+        if (t->cold->rcu_nesting > 0 && t->cold->rcu_qs < gp) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int uthread_synchronize_rcu(void) {
+    if (!scheduler_initialized) {
+        return 0;               // No other uthread can be reading
+    }
+    if (running_thread->kind == THREAD_KIND_TASK) {
+        return -1;
+    }
+    if (running_thread->cold->rcu_nesting > 0) {
+        errno = EDEADLK;        // Would wait for itself
+        return -1;
+    }
+
+    block_signals();
+    unsigned long gp = ++rcu_gp_seq;
+    while (!rcu_gp_done(gp)) {
+        unblock_signals();
+        scheduler_yield();
+        block_signals();
+    }
+    unblock_signals();
+    return 0;
+}
+
+static void rcu_reclaimer_main(void *arg) {
+    (void)arg;
+
+    block_signals();
+    rcu_reclaimer = running_thread;
+    unblock_signals();
+
+    for (;;) {
+        block_signals();
+        while (rcu_callbacks == NULL) {
+            running_thread->state = THREAD_BLOCKED;
+            scheduler_schedule();
+        }
+        uthread_rcu_head_t *batch = rcu_callbacks;
+        rcu_callbacks = NULL;
+        rcu_callbacks_tail = &rcu_callbacks;
+        unblock_signals();
+
+        uthread_synchronize_rcu();
+        while (batch != NULL) {
+            uthread_rcu_head_t *next = batch->next;
+            batch->func(batch);
+            batch = next;
+        }
+    }
+}
+
+int uthread_call_rcu(uthread_rcu_head_t *head, void (*func)(uthread_rcu_head_t *head)) {
+    if (head == NULL || func == NULL) {
+        return -1;
+    }
+
+    block_signals();
+    bool spawn = !rcu_reclaimer_spawned;
+    rcu_reclaimer_spawned = true;
+    unblock_signals();
+
+    if (spawn && uthread_create(rcu_reclaimer_main, NULL) < 0) {
+        rcu_reclaimer_spawned = false;
+        return -1;
+    }
+
+    block_signals();
+    head->func = func;
+    head->next = NULL;
+    *rcu_callbacks_tail = head;
+    rcu_callbacks_tail = &head->next;
+    unblock_thread(rcu_reclaimer); // Not yet running: it checks the list first
+    unblock_signals();
+    return 0;
+}
+
+// Uthread-local storage
+//
+// The first UTHREAD_KEYS_INLINE values live in thread_t so the common case
+// is a single indexed load; higher keys go to a per-thread overflow table
+// allocated on first use. Only threads that stored a non-NULL value pay
+// for the destructor pass in uthread_exit().
+
+int uthread_key_create(uthread_key_t *key, void (*destructor)(void *)) {
+    if (key == NULL) {
+        return -1;
+    }
+
+    block_signals();
+
+    if (!scheduler_initialized) {
+        scheduler_init();
+    }
+
+    for (uthread_key_t k = 0; k < UTHREAD_KEYS_MAX; k++) {
+        if (tls_key_used[k]) {
+            continue;
+        }
+        tls_key_used[k] = true;
+        tls_destructors[k] = destructor;
+
+        // Clear values left behind by a deleted key with the same index
+        // (through threads[i].cold, which for arena slots is not thread_cold[i])
+        for (int i = 0; i < MAX_THREADS; i++) {
+            thread_cold_t *cold = threads[i].cold;
+            if (k < UTHREAD_KEYS_INLINE) {
+                cold->tls_inline[k] = NULL;
+            } else if (cold->tls_overflow) {
+                cold->tls_overflow[k - UTHREAD_KEYS_INLINE] = NULL;
+            }
+        }
+
+        *key = k;
+        unblock_signals();
+        return 0;
+    }
+    unblock_signals();
+    errno = EAGAIN;
+    return -1;
+}
+
+int uthread_key_delete(uthread_key_t key) {
+    if (key >= UTHREAD_KEYS_MAX || !tls_key_used[key]) {
+        return -1;
+    }
+    block_signals();
+    tls_key_used[key] = false;
+    tls_destructors[key] = NULL;
+    unblock_signals();
+    return 0;
+}
+
+void *uthread_getspecific(uthread_key_t key) {
+    thread_t *self = running_thread;
+    if (self == NULL || key >= UTHREAD_KEYS_MAX || self->kind == THREAD_KIND_TASK) {
+        return NULL;
+    }
+    if (key < UTHREAD_KEYS_INLINE) {
+        return self->cold->tls_inline[key];
+    }
+    if (self->cold->tls_overflow == NULL) {
+        return NULL;
+    }
+    return self->cold->tls_overflow[key - UTHREAD_KEYS_INLINE];
+}
+
+int uthread_setspecific(uthread_key_t key, const void *value) {
+    if (key >= UTHREAD_KEYS_MAX || !tls_key_used[key]) {
+        return -1;
+    }
+
+    if (!scheduler_initialized) {
+        block_signals();
+        scheduler_init();
+        unblock_signals();
+    }
+
+    thread_t *self = running_thread;
+    if (self->kind == THREAD_KIND_TASK) {
+        return -1;
+    }
+    if (key < UTHREAD_KEYS_INLINE) {
+        self->cold->tls_inline[key] = (void *)value;
+    } else {
+        if (self->cold->tls_overflow == NULL) {
+            if (value == NULL) {
+                return 0;
+            }
+            block_signals();
+            self->cold->tls_overflow = calloc(UTHREAD_KEYS_MAX - UTHREAD_KEYS_INLINE,
+                                        sizeof(void *));
+            unblock_signals();
+            if (self->cold->tls_overflow == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+        }
+        self->cold->tls_overflow[key - UTHREAD_KEYS_INLINE] = (void *)value;
+    }
+
+    if (value != NULL) {
+        self->cold->tls_used = true;
+    }
+    return 0;
+}
+
+static void tls_run_destructors(thread_t *thread) {
+    for (int round = 0; round < UTHREAD_DESTRUCTOR_ITERATIONS; round++) {
+        bool called = false;
+        for (uthread_key_t k = 0; k < UTHREAD_KEYS_MAX; k++) {
+            void **slot;
+            if (k < UTHREAD_KEYS_INLINE) {
+                slot = &thread->cold->tls_inline[k];
+            } else if (thread->cold->tls_overflow) {
+                slot = &thread->cold->tls_overflow[k - UTHREAD_KEYS_INLINE];
+            } else {
+                break;
+            }
+
+            void *value = *slot;
+            if (value == NULL || !tls_key_used[k]) {
+                continue;
+            }
+            *slot = NULL;
+            if (tls_destructors[k]) {
+                tls_destructors[k](value);
+                called = true;
+            }
+        }
+        if (!called) {
+            break;
+        }
+    }
+
+    block_signals();
+    free(thread->cold->tls_overflow);
+    thread->cold->tls_overflow = NULL;
+    thread->cold->tls_used = false;
+    unblock_signals();
+}
+
+int (uthread_mutex_init)(mutex_t *mutex) {
+    if (mutex == NULL) {
+        return -1;
+    }
+    mutex->locked = 0;
+    mutex->owner = NULL;
+    mutex->waiting_list = NULL;
+#ifdef UTHREAD_LOCKDEP
+    mutex->lock_class = lockdep_class(NULL, 0, __builtin_return_address(0));
+#endif
+    return 0;
+}
+
+#ifdef UTHREAD_LOCKDEP
+int uthread_mutex_init_site(mutex_t *mutex, const char *file, int line) {
+    if (mutex == NULL) {
+        return -1;
+    }
+    mutex->locked = 0;
+    mutex->owner = NULL;
+    mutex->waiting_list = NULL;
+    mutex->lock_class = lockdep_class(file, line, NULL);
+    return 0;
+}
+#endif
+
+int uthread_mutex_lock(mutex_t *mutex) {
+    block_signals();
+
+    if (mutex == NULL || running_thread == NULL) {
+        unblock_signals();
+        return -1;
+    }
+
+    LOCKDEP_CHECK(mutex->lock_class);
+    
+    if (mutex->locked == 0) {
+        mutex->locked = 1;
+        mutex->owner = running_thread;
+        LOCKDEP_PUSH(mutex->lock_class, mutex);
+        unblock_signals();
+        return 0;
+    }
+    
+    if (mutex->owner == running_thread) {
+        unblock_signals();
+        errno = EDEADLK;
+        return -1;
+    }
+
+    // Tasks cannot park here; they use UTHREAD_TASK_LOCK
+    if (running_thread->kind == THREAD_KIND_TASK) {
+        unblock_signals();
+        errno = EAGAIN;
+        return -1;
+    }
+    
+    running_thread->blocked_on = mutex;
+    if (wfg_check_block(running_thread) != 0) {
+        running_thread->blocked_on = NULL;
+        unblock_signals();
+        errno = EDEADLK;
+        return -1;
+    }
+    park_on(&mutex->waiting_list);
+    
+    // Ownership was handed over by uthread_mutex_unlock()
+    LOCKDEP_PUSH(mutex->lock_class, mutex);
+    unblock_signals();
+    return 0;
+}
+
+int uthread_mutex_unlock(mutex_t *mutex) {
+    block_signals();
+
+    if (mutex == NULL || running_thread == NULL) {
+        unblock_signals();
+        return -1;
+    }
+    
+    if (mutex->owner != running_thread) {
+        unblock_signals();
+        return -1;
+    }
+
+    LOCKDEP_POP(mutex);
+    
+    if (mutex->waiting_list != NULL) {
+        // Hand the mutex straight to the first waiter so that no other
+        // thread can take it before the waiter gets to run
+        thread_t *next = mutex->waiting_list;
+        mutex->waiting_list = next->next;
+        mutex->owner = next;
+        unblock_thread(next);
+    } else {
+        mutex->locked = 0;
+        mutex->owner = NULL;
+    }
+    
+    unblock_signals();
+    return 0;
+}
+
+static void safe_print_str(const char *s) {
+    write(STDOUT_FILENO, s, strlen(s));
+}
+
+static void safe_print_int(int n) {
+    char buffer[32];
+    int i = 0;
+    if (n == 0) {
+        buffer[i++] = '0';
+    } else {
+        if (n < 0) {
+            safe_print_str("-");
+            n = -n;
+        }
+        int temp = n;
+        int len = 0;
+        int temp_len = n;
+        while (temp_len > 0) {
+            temp_len /= 10;
+            len++;
+        }
+        
+        i = len;
+        while (temp > 0) {
+            buffer[--len] = '0' + (temp % 10);
+            temp /= 10;
+        }
+    }
+    write(STDOUT_FILENO, buffer, i);
+}
+
+// Wait-for graph
+//
+// Every blocked thread has exactly one wait edge (blocked_on,
+// blocked_on_rw or waiting_for), set before it blocks and cleared by
+// unblock_thread(). Holders are kept current by the lock operations, so
+// the successors of a thread are always its resource's present holders.
+// Cycle checks at block time only walk what is reachable from the caller.
+
+static unsigned wfg_epoch = 0;
+static thread_t *wfg_path[MAX_THREADS];
+static int wfg_next_edge[MAX_THREADS];
+
+// Returns the i-th thread that `t` waits for, or NULL past the last one
+static thread_t *wfg_edge(thread_t *t, int i) {
+    if (t->blocked_on != NULL) {
+        return i == 0 ? t->blocked_on->owner : NULL;
+    }
+    if (t->waiting_for != NULL) {
+        return i == 0 ? t->waiting_for : NULL;
+    }
+    if (t->blocked_on_future != NULL) {
+        return i == 0 ? t->blocked_on_future->producer : NULL;
+    }
+    if (t->blocked_on_rw != NULL) {
+        rwlock_t *rwlock = t->blocked_on_rw;
+        if (rwlock->writer != NULL) {
+            if (i == 0) {
+                return rwlock->writer;
+            }
+            i--;
+        }
+        if (t->is_writer) {
+            rw_reader_t *reader = rwlock->readers_list;
+            while (reader != NULL && i-- > 0) {
+                reader = reader->next;
+            }
+            return reader ? reader->thread : NULL;
+        }
+        // Readers queue behind waiting writers
+        thread_t *writer = rwlock->write_waiting;
+        while (writer != NULL && i-- > 0) {
+            writer = writer->next;
+        }
+        return writer;
+    }
+    return NULL;
+}
+
+static const char *wfg_edge_kind(thread_t *t) {
+    if (t->blocked_on != NULL) {
+        return "mutex";
+    }
+    if (t->waiting_for != NULL) {
+        return "join";
+    }
+    if (t->blocked_on_future != NULL) {
+        return "future";
+    }
+    return t->blocked_on_rw && t->is_writer ? "rwlock (write)" : "rwlock (read)";
+}
+
+// Depth-first search from `self` along wait edges. On success the cycle
+// is left in wfg_path[0..depth) and its length is returned.
+static int wfg_find_cycle(thread_t *self) {
+    wfg_epoch++;
+    int top = 0;
+    wfg_path[0] = self;
+    wfg_next_edge[0] = 0;
+    self->wfg_mark = wfg_epoch;
+
+    while (top >= 0) {
+        thread_t *succ = wfg_edge(wfg_path[top], wfg_next_edge[top]++);
+        if (succ == NULL) {
+            top--;
+            continue;
+        }
+        if (succ == self) {
+            return top + 1;
+        }
+        if (succ->wfg_mark == wfg_epoch || succ->state != THREAD_BLOCKED ||
+            top + 1 >= MAX_THREADS) {
+            continue;
+        }
+        succ->wfg_mark = wfg_epoch;
+        top++;
+        wfg_path[top] = succ;
+        wfg_next_edge[top] = 0;
+    }
+    return 0;
+}
+
+// Called with the caller's wait edge set but before it blocks.
+// Returns -1 if the policy says the blocking call must fail.
+static int wfg_check_block(thread_t *self) {
+    if (deadlock_policy == DEADLOCK_IGNORE) {
+        return 0;
+    }
+
+    int depth = wfg_find_cycle(self);
+    if (depth == 0) {
+        return 0;
+    }
+    if (deadlock_policy == DEADLOCK_FAIL) {
+        return -1;
+    }
+
+    safe_print_str("Deadlock detected! ");
+    for (int i = 0; i < depth; i++) {
+        safe_print_str("Thread ");
+        safe_print_int(wfg_path[i]->tid);
+        safe_print_str(" -(");
+        safe_print_str(wfg_edge_kind(wfg_path[i]));
+        safe_print_str(")-> ");
+    }
+    safe_print_str("Thread ");
+    safe_print_int(self->tid);
+    safe_print_str("\n");
+    return 0;
+}
+
+void uthread_set_deadlock_policy(deadlock_policy_t policy) {
+    block_signals();
+    deadlock_policy = policy;
+    unblock_signals();
+}
+
+// Tarjan's strongly connected components over the thread table, done
+// iteratively since this runs on whatever uthread stack SIGQUIT hits.
+static int scc_index[MAX_THREADS];
+static int scc_low[MAX_THREADS];
+static bool scc_on_stack[MAX_THREADS];
+static int scc_stack[MAX_THREADS];
+static int scc_call[MAX_THREADS];
+static int scc_call_edge[MAX_THREADS];
+
+static bool wfg_live(int slot) {
+    return (slot == 0 || threads[slot].tid != 0) &&
+           threads[slot].state != THREAD_TERMINATED;
+}
+
+static int wfg_slot(thread_t *t) {
+    if (t == NULL || t < threads || t >= threads + MAX_THREADS) {
+        return -1;
+    }
+    int slot = (int)(t - threads);
+    return wfg_live(slot) ? slot : -1;
+}
+
+static void print_scc(int *members, int count) {
+    safe_print_str("Deadlock detected! Cycle involving threads");
+    for (int i = 0; i < count; i++) {
+        safe_print_str(i == 0 ? " " : ", ");
+        safe_print_int(threads[members[i]].tid);
+    }
+    safe_print_str("\n");
+
+    for (int i = 0; i < count; i++) {
+        thread_t *t = &threads[members[i]];
+        thread_t *succ;
+        for (int e = 0; (succ = wfg_edge(t, e)) != NULL; e++) {
+            int s = wfg_slot(succ);
+            bool in_scc = false;
+            for (int k = 0; k < count && s >= 0; k++) {
+                in_scc = in_scc || members[k] == s;
+            }
+            if (!in_scc) {
+                continue;
+            }
+            safe_print_str("  Thread ");
+            safe_print_int(t->tid);
+            safe_print_str(" -(");
+            safe_print_str(wfg_edge_kind(t));
+            safe_print_str(")-> Thread ");
+            safe_print_int(succ->tid);
+            safe_print_str("\n");
+        }
+    }
+}
+
+static void print_deadlock_report(void) {
+    
+    safe_print_str("Deadlock report:\n");
+
+    int deadlocks = 0;
+    int next_index = 0;
+    int sp = 0;
+
+    for (int i = 0; i < MAX_THREADS; i++) {
+        scc_index[i] = -1;
+        scc_on_stack[i] = false;
+    }
+
+    for (int root = 0; root < MAX_THREADS; root++) {
+        if (!wfg_live(root) || scc_index[root] >= 0) {
+            continue;
+        }
+
+        int depth = 0;
+        scc_call[0] = root;
+        scc_call_edge[0] = 0;
+        scc_index[root] = scc_low[root] = next_index++;
+        scc_stack[sp++] = root;
+        scc_on_stack[root] = true;
+
+        while (depth >= 0) {
+            int v = scc_call[depth];
+            thread_t *succ = wfg_edge(&threads[v], scc_call_edge[depth]++);
+
+            if (succ != NULL) {
+                int w = wfg_slot(succ);
+                if (w < 0) {
+                    continue;
+                }
+                if (scc_index[w] < 0) {
+                    scc_index[w] = scc_low[w] = next_index++;
+                    scc_stack[sp++] = w;
+                    scc_on_stack[w] = true;
+                    depth++;
+                    scc_call[depth] = w;
+                    scc_call_edge[depth] = 0;
+                } else if (scc_on_stack[w] && scc_index[w] < scc_low[v]) {
+                    scc_low[v] = scc_index[w];
+                }
+                continue;
+            }
+
+            // All edges of v done: pop the component if v is its root
+            if (scc_low[v] == scc_index[v]) {
+                int start = sp;
+                do {
+                    start--;
+                } while (scc_stack[start] != v);
+
+                int count = sp - start;
+                bool self_loop = false;
+                thread_t *e;
+                for (int k = 0; (e = wfg_edge(&threads[v], k)) != NULL; k++) {
+                    if (e == &threads[v]) {
+                        self_loop = true;
+                    }
+                }
+                if (count > 1 || self_loop) {
+                    print_scc(&scc_stack[start], count);
+                    deadlocks++;
+                }
+                for (int k = start; k < sp; k++) {
+                    scc_on_stack[scc_stack[k]] = false;
+                }
+                sp = start;
+            }
+
+            depth--;
+            if (depth >= 0) {
+                int parent = scc_call[depth];
+                if (scc_low[v] < scc_low[parent]) {
+                    scc_low[parent] = scc_low[v];
+                }
+            }
+        }
+    }
+    
+    if (deadlocks == 0) {
+        safe_print_str("No deadlock detected.\n");
+    }
+}
+
+int (uthread_rwlock_init)(rwlock_t *rwlock) {
+    if (rwlock == NULL) {
+        return -1;
+    }
+    rwlock->readers = 0;
+    rwlock->writer = NULL;
+    rwlock->read_waiting = NULL;
+    rwlock->write_waiting = NULL;
+    rwlock->readers_list = NULL;
+#ifdef UTHREAD_LOCKDEP
+    rwlock->lock_class = lockdep_class(NULL, 0, __builtin_return_address(0));
+#endif
+    return 0;
+}
+
+#ifdef UTHREAD_LOCKDEP
+int uthread_rwlock_init_site(rwlock_t *rwlock, const char *file, int line) {
+    if (rwlock == NULL) {
+        return -1;
+    }
+    rwlock->readers = 0;
+    rwlock->writer = NULL;
+    rwlock->read_waiting = NULL;
+    rwlock->write_waiting = NULL;
+    rwlock->readers_list = NULL;
+    rwlock->lock_class = lockdep_class(file, line, NULL);
+    return 0;
+}
+#endif
+
+// Takes a free hold record of `thread` and links it into the readers list
+static int rwlock_add_reader(rwlock_t *rwlock, thread_t *thread) {
+    for (int i = 0; i < UTHREAD_MAX_READ_HOLDS; i++) {
+        rw_reader_t *hold = &thread->cold->read_holds[i];
+        if (hold->thread == NULL) {
+            hold->thread = thread;
+            hold->next = rwlock->readers_list;
+            rwlock->readers_list = hold;
+            rwlock->readers++;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static bool rwlock_has_free_hold(thread_t *thread) {
+    for (int i = 0; i < UTHREAD_MAX_READ_HOLDS; i++) {
+        if (thread->cold->read_holds[i].thread == NULL) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int uthread_rwlock_rdlock(rwlock_t *rwlock) {
+    block_signals();
+
+    if (rwlock == NULL || running_thread == NULL ||
+        running_thread->kind == THREAD_KIND_TASK) {
+        unblock_signals();
+        return -1;
+    }
+
+    if (!rwlock_has_free_hold(running_thread)) {
+        unblock_signals();
+        errno = EAGAIN;
+        return -1;
+    }
+
+    LOCKDEP_CHECK(rwlock->lock_class);
+    
+    // If no writer and no writers waiting, allow read
+    if (rwlock->writer == NULL && rwlock->write_waiting == NULL) {
+        rwlock_add_reader(rwlock, running_thread);
+        LOCKDEP_PUSH(rwlock->lock_class, rwlock);
+        unblock_signals();
+        return 0;
+    }
+    
+    running_thread->blocked_on_rw = rwlock;
+    running_thread->is_writer = false;
+    if (wfg_check_block(running_thread) != 0) {
+        running_thread->blocked_on_rw = NULL;
+        unblock_signals();
+        errno = EDEADLK;
+        return -1;
+    }
+    park_on(&rwlock->read_waiting);
+    
+    // The read lock was handed over by uthread_rwlock_unlock()
+    LOCKDEP_PUSH(rwlock->lock_class, rwlock);
+    unblock_signals();
+    return 0;
+}
+
+int uthread_rwlock_wrlock(rwlock_t *rwlock) {
+    block_signals();
+
+    if (rwlock == NULL || running_thread == NULL ||
+        running_thread->kind == THREAD_KIND_TASK) {
+        unblock_signals();
+        return -1;
+    }
+
+    if (rwlock->writer == running_thread) {
+        unblock_signals();
+        errno = EDEADLK;
+        return -1;
+    }
+
+    LOCKDEP_CHECK(rwlock->lock_class);
+    
+    // If no readers and no writer, allow write
+    if (rwlock->readers == 0 && rwlock->writer == NULL) {
+        rwlock->writer = running_thread;
+        LOCKDEP_PUSH(rwlock->lock_class, rwlock);
+        unblock_signals();
+        return 0;
+    }
+    
+    // Block and wait
+    running_thread->blocked_on_rw = rwlock;
+    running_thread->is_writer = true;
+    if (wfg_check_block(running_thread) != 0) {
+        running_thread->blocked_on_rw = NULL;
+        unblock_signals();
+        errno = EDEADLK;
+        return -1;
+    }
+    park_on(&rwlock->write_waiting);
+    
+    // The write lock was handed over by uthread_rwlock_unlock()
+    LOCKDEP_PUSH(rwlock->lock_class, rwlock);
+    unblock_signals();
+    return 0;
+}
+
+// Hands the lock to the first waiting writer, if any
+static void rwlock_wake_writer(rwlock_t *rwlock) {
+    if (rwlock->write_waiting != NULL) {
+        thread_t *next = rwlock->write_waiting;
+        rwlock->write_waiting = next->next;
+        rwlock->writer = next;
+        unblock_thread(next);
+    }
+}
+
+// Read-write lock unlock
+int uthread_rwlock_unlock(rwlock_t *rwlock) {
+    block_signals();
+
+    if (rwlock == NULL || running_thread == NULL) {
+        unblock_signals();
+        return -1;
+    }
+    
+    if (rwlock->writer == running_thread) {
+        // Unlocking write lock
+        LOCKDEP_POP(rwlock);
+        rwlock->writer = NULL;
+        
+        if (rwlock->read_waiting != NULL) {
+            // Hand read holds to all waiting readers, then wake them at once
+            for (thread_t *next = rwlock->read_waiting; next != NULL; next = next->next) {
+                rwlock_add_reader(rwlock, next);
+            }
+            wake_all(rwlock->read_waiting);
+            rwlock->read_waiting = NULL;
+        } else {
+            rwlock_wake_writer(rwlock);
+        }
+    } else {
+        // Check if thread is a reader
+        rw_reader_t *reader = rwlock->readers_list;
+        rw_reader_t *prev_reader = NULL;
+        
+        while (reader != NULL && reader->thread != running_thread) {
+            prev_reader = reader;
+            reader = reader->next;
+        }
+        
+        if (reader == NULL) {
+            unblock_signals();
+            return -1; 
+        }
+
+        // Unlocking read lock
+        LOCKDEP_POP(rwlock);
+        if (prev_reader == NULL) {
+            rwlock->readers_list = reader->next;
+        } else {
+            prev_reader->next = reader->next;
+        }
+        reader->thread = NULL;
+        reader->next = NULL;
+        rwlock->readers--;
+        
+        // If last reader, hand over to a waiting writer
+        if (rwlock->readers == 0) {
+            rwlock_wake_writer(rwlock);
+        }
+    }
+    
+    unblock_signals();
+    return 0;
+}
+
+int uthread_rwlock_destroy(rwlock_t *rwlock) {
+    if (rwlock == NULL) {
+        return -1;
+    }
+    
+    if (rwlock->readers > 0 || rwlock->writer != NULL) {
+        return -1; // Lock is still in use
+    }
+    rwlock->readers = 0;
+    rwlock->writer = NULL;
+    rwlock->read_waiting = NULL;
+    rwlock->write_waiting = NULL;
+    rwlock->readers_list = NULL;
+    
+    return 0;
+}
+
+void deadlock_detect(void) {
+    print_deadlock_report();
+}
+
+// Sequence locks
+//
+// The count is bumped once on entry and once on exit of each write, with
+// release ordering, so a reader that saw the same even value before and
+// after its copy read a consistent snapshot. The read side is inline in
+// uthread.h and never writes the lock.
+
+int (uthread_seqlock_init)(uthread_seqlock_t *sl) {
+    if (sl == NULL) {
+        return -1;
+    }
+    sl->seq = 0;
+    (uthread_mutex_init)(&sl->lock);
+#ifdef UTHREAD_LOCKDEP
+    sl->lock.lock_class = lockdep_class(NULL, 0, __builtin_return_address(0));
+#endif
+    return 0;
+}
+
+#ifdef UTHREAD_LOCKDEP
+int uthread_seqlock_init_site(uthread_seqlock_t *sl, const char *file, int line) {
+    if (sl == NULL) {
+        return -1;
+    }
+    sl->seq = 0;
+    return uthread_mutex_init_site(&sl->lock, file, line);
+}
+#endif
+
+int uthread_write_seqlock(uthread_seqlock_t *sl) {
+    if (sl == NULL || uthread_mutex_lock(&sl->lock) != 0) {
+        return -1;
+    }
+    __atomic_store_n(&sl->seq, sl->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return 0;
+}
+
+int uthread_write_sequnlock(uthread_seqlock_t *sl) {
+    if (sl == NULL || sl->lock.owner != running_thread) {
+        return -1;
+    }
+    __atomic_store_n(&sl->seq, sl->seq + 1, __ATOMIC_RELEASE);
+    return uthread_mutex_unlock(&sl->lock);
+}
+
+// Wait-on-address
+//
+// Waiters hash on the address into FIFO lists; each waiter's record sits
+// on its own stack for the duration of the wait. Timed waits are expired
+// from the preemption tick, so a timeout is honoured to within a quantum.
+
+enum {
+    WAIT_QUEUED,
+    WAIT_WOKEN,
+    WAIT_TIMEDOUT
+};
+
+typedef struct wait_node {
+    thread_t *thread;
+    const unsigned *addr;
+    bool timed;
+    struct timespec deadline;   // CLOCK_MONOTONIC, if timed
+    int status;
+    struct wait_node *next;
+} wait_node_t;
+
+static wait_node_t *wait_table[WAIT_BUCKETS];
+static int wait_timed = 0;      // Timed waiters in the table
+
+static wait_node_t **wait_bucket(const unsigned *addr) {
+    uint64_t key = (uint64_t)(uintptr_t)addr >> 2;
+    return &wait_table[(key * 0x9e3779b97f4a7c15ULL) >> (64 - WAIT_BUCKET_BITS)];
+}
+
+static bool timespec_before(const struct timespec *a, const struct timespec *b) {
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+// Takes `node` off its list and makes its thread runnable
+static void wait_finish(wait_node_t **link, int status) {
+    wait_node_t *node = *link;
+    *link = node->next;
+    if (node->timed) {
+        wait_timed--;
+    }
+    node->status = status;
+    unblock_thread(node->thread);
+}
+
+// Times out every waiter whose deadline has passed
+static void wait_expire(void) {
+    if (wait_timed == 0) {
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = 0; i < WAIT_BUCKETS; i++) {
+        wait_node_t **link = &wait_table[i];
+        while (*link != NULL) {
+            if ((*link)->timed && !timespec_before(&now, &(*link)->deadline)) {
+                wait_finish(link, WAIT_TIMEDOUT);
+            } else {
+                link = &(*link)->next;
+            }
+        }
+    }
+}
+
+// Every thread is blocked: sleeps until the earliest deadline and expires
+// it. Returns -1 if no wait is timed, as then nothing is left that could
+// wake anyone.
+static int wait_idle(void) {
+    if (wait_timed == 0) {
+        return -1;
+    }
+
+    struct timespec earliest = { 0, 0 };
+    bool found = false;
+    for (int i = 0; i < WAIT_BUCKETS; i++) {
+        for (wait_node_t *node = wait_table[i]; node != NULL; node = node->next) {
+            if (node->timed && (!found || timespec_before(&node->deadline, &earliest))) {
+                earliest = node->deadline;
+                found = true;
+            }
+        }
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &earliest, NULL) == EINTR);
+    wait_expire();
+    return 0;
+}
+
+static bool wait_queued(const thread_t *thread) {
+    for (int i = 0; i < WAIT_BUCKETS; i++) {
+        for (wait_node_t *node = wait_table[i]; node != NULL; node = node->next) {
+            if (node->thread == thread) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+int uthread_wait(const unsigned *addr, unsigned expected, const struct timespec *timeout) {
+    block_signals();
+
+    if (!scheduler_initialized) {
+        scheduler_init();
+    }
+
+    if (addr == NULL || running_thread->kind == THREAD_KIND_TASK ||
+        (timeout != NULL && (timeout->tv_sec < 0 || timeout->tv_nsec < 0 ||
+                             timeout->tv_nsec >= 1000000000L))) {
+        unblock_signals();
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Compared with the timer masked, so no wake can slip in before we queue
+    if (__atomic_load_n(addr, __ATOMIC_ACQUIRE) != expected) {
+        unblock_signals();
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (timeout != NULL && timeout->tv_sec == 0 && timeout->tv_nsec == 0) {
+        unblock_signals();
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    wait_node_t node = { running_thread, addr, timeout != NULL, { 0, 0 }, WAIT_QUEUED, NULL };
+    if (timeout != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &node.deadline);
+        node.deadline.tv_sec += timeout->tv_sec;
+        node.deadline.tv_nsec += timeout->tv_nsec;
+        if (node.deadline.tv_nsec >= 1000000000L) {
+            node.deadline.tv_sec++;
+            node.deadline.tv_nsec -= 1000000000L;
+        }
+        wait_timed++;
+    }
+
+    wait_node_t **link = wait_bucket(addr);
+    while (*link != NULL) {
+        link = &(*link)->next;
+    }
+    *link = &node;
+
+    running_thread->state = THREAD_BLOCKED;
+    scheduler_schedule();
+
+    // Resumed still queued: every thread is blocked and nothing is timed
+    if (node.status == WAIT_QUEUED) {
+        for (link = wait_bucket(addr); *link != &node; link = &(*link)->next);
+        *link = node.next;
+        unblock_signals();
+        errno = EDEADLK;
+        return -1;
+    }
+
+    unblock_signals();
+    if (node.status == WAIT_TIMEDOUT) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
+
+int uthread_wake(const unsigned *addr, int n) {
+    if (addr == NULL || n < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    block_signals();
+    int woken = 0;
+    wait_node_t **link = wait_bucket(addr);
+    while (*link != NULL && woken < n) {
+        if ((*link)->addr == addr) {
+            wait_finish(link, WAIT_WOKEN);
+            woken++;
+        } else {
+            link = &(*link)->next;
+        }
+    }
+    unblock_signals();
+    return woken;
+}
+
+#ifdef UTHREAD_LOCKDEP
+// Lock-order validator
+//
+// Classes are numbered from 1 (0 means untracked). lockdep_after[a] has
+// bit b set once class b was taken while class a was held. Taking class c
+// while holding h is an inversion if c already reaches h in that graph.
+// Re-taking the same class (e.g. an array of locks initialised in a loop)
+// is not checked, since there is no way to annotate a nesting order.
+
+typedef struct lock_class {
+    const char *file;           // Init site, or NULL when only caller is known
+    int line;
+    const void *caller;         // Return address of the init call
+} lock_class_t;
+
+#define LOCKDEP_WORDS (LOCKDEP_MAX_CLASSES / 64)
+
+static lock_class_t lock_classes[LOCKDEP_MAX_CLASSES];
+static int lock_class_count = 1;
+static uint64_t lockdep_after[LOCKDEP_MAX_CLASSES][LOCKDEP_WORDS];
+static uint64_t lockdep_reported[LOCKDEP_MAX_CLASSES][LOCKDEP_WORDS];
+static int lockdep_report_count = 0;
+
+static bool lockdep_test(uint64_t (*set)[LOCKDEP_WORDS], int a, int b) {
+    return (set[a][b / 64] >> (b % 64)) & 1;
+}
+
+static void lockdep_set(uint64_t (*set)[LOCKDEP_WORDS], int a, int b) {
+    set[a][b / 64] |= (uint64_t)1 << (b % 64);
+}
+
+static int lockdep_class(const char *file, int line, const void *caller) {
+    block_signals();
+    for (int i = 1; i < lock_class_count; i++) {
+        lock_class_t *c = &lock_classes[i];
+        if (c->caller == caller && c->line == line &&
+            (c->file == file || (c->file && file && strcmp(c->file, file) == 0))) {
+            unblock_signals();
+            return i;
+        }
+    }
+
+    int cls = 0;
+    if (lock_class_count < LOCKDEP_MAX_CLASSES) {
+        cls = lock_class_count++;
+        lock_classes[cls].file = file;
+        lock_classes[cls].line = line;
+        lock_classes[cls].caller = caller;
+    }
+    unblock_signals();
+    return cls;
+}
+
+static void lockdep_print_class(int cls) {
+    lock_class_t *c = &lock_classes[cls];
+    if (c->file) {
+        safe_print_str(c->file);
+        safe_print_str(":");
+        safe_print_int(c->line);
+    } else {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%p", c->caller);
+        safe_print_str("init@");
+        safe_print_str(buffer);
+    }
+}
+
+// True if `to` is reachable from `from` in the recorded order graph
+static bool lockdep_reaches(int from, int to) {
+    static int stack[LOCKDEP_MAX_CLASSES];
+    uint64_t seen[LOCKDEP_WORDS] = {0};
+    int top = 0;
+
+    stack[top++] = from;
+    seen[from / 64] |= (uint64_t)1 << (from % 64);
+    while (top > 0) {
+        int cls = stack[--top];
+        for (int w = 0; w < LOCKDEP_WORDS; w++) {
+            uint64_t next = lockdep_after[cls][w] & ~seen[w];
+            while (next) {
+                int b = w * 64 + __builtin_ctzll(next);
+                next &= next - 1;
+                if (b == to) {
+                    return true;
+                }
+                seen[w] |= (uint64_t)1 << (b % 64);
+                stack[top++] = b;
+            }
+        }
+    }
+    return false;
+}
+
+// Threads keep their held-lock stack in the cold half. Tasks get theirs
+// on their first lock, so a task stays small; NULL means it holds nothing
+// (or that allocation failed and it goes untracked).
+static lockdep_held_t *lockdep_held(thread_t *t, bool create) {
+    if (t->kind != THREAD_KIND_TASK) {
+        return &t->cold->held;
+    }
+    uthread_task_t *task = (uthread_task_t *)t;
+    if (task->held == NULL && create) {
+        task->held = calloc(1, sizeof(*task->held));
+    }
+    return task->held;
+}
+
+static void lockdep_check(int cls) {
+    thread_t *self = running_thread;
+    lockdep_held_t *held_locks = lockdep_held(self, false);
+    if (cls == 0 || held_locks == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < held_locks->count; i++) {
+        int held = held_locks->classes[i];
+        if (held == 0 || held == cls || lockdep_test(lockdep_after, held, cls)) {
+            continue;
+        }
+
+        if (!lockdep_reaches(cls, held)) {
+            lockdep_set(lockdep_after, held, cls);
+            continue;
+        }
+
+        if (!lockdep_test(lockdep_reported, held, cls)) {
+            lockdep_set(lockdep_reported, held, cls);
+            lockdep_report_count++;
+            safe_print_str("Possible lock inversion! Thread ");
+            safe_print_int(self->tid);
+            safe_print_str(" takes ");
+            lockdep_print_class(cls);
+            safe_print_str(" while holding ");
+            lockdep_print_class(held);
+            safe_print_str(", but the reverse order was seen before\n");
+        }
+    }
+}
+
+static void lockdep_push(int cls, void *lock) {
+    lockdep_held_t *self = lockdep_held(running_thread, true);
+    if (self != NULL && self->count < UTHREAD_LOCKDEP_DEPTH) {
+        self->classes[self->count] = cls;
+        self->locks[self->count] = lock;
+        self->count++;
+    }
+}
+
+static void lockdep_pop(void *lock) {
+    lockdep_held_t *self = lockdep_held(running_thread, false);
+    if (self == NULL) {
+        return;
+    }
+    for (int i = self->count - 1; i >= 0; i--) {
+        if (self->locks[i] == lock) {
+            for (int j = i; j < self->count - 1; j++) {
+                self->classes[j] = self->classes[j + 1];
+                self->locks[j] = self->locks[j + 1];
+            }
+            self->count--;
+            return;
+        }
+    }
+}
+
+int uthread_lockdep_reports(void) {
+    return lockdep_report_count;
+}
+#endif
+
+// Sampling profiler
+//
+// SIGPROF fires on ITIMER_PROF and the handler records the running
+// uthread's tid together with a frame-pointer backtrace of the
+// interrupted context. The walk is bounded by the uthread's own stack
+// (or the main thread's), so it never strays across makecontext stacks.
+// Samples go into a single-producer ring: the handler is the only writer
+// and SIGALRM is masked while it runs, so no preemption can interleave
+// two producers.
+
+typedef struct prof_sample {
+    int tid;
+    int depth;
+    void *ips[PROF_MAX_DEPTH];  // Leaf first
+} prof_sample_t;
+
+static prof_sample_t *prof_buffer = NULL;
+static atomic_uint prof_head;
+static atomic_uint prof_tail;
+static atomic_uint prof_dropped;
+static char *prof_altstack = NULL;     // prof_handler runs here, not on uthread stacks
+static char *main_stack_lo = NULL;
+static char *main_stack_hi = NULL;
+
+static void prof_stack_bounds(char *sp, char **lo, char **hi) {
+    thread_t *t = running_thread;
+    if (t && t->kind == THREAD_KIND_TASK) {
+        t = NULL;
+    }
+    if (t && t->cold->stack && sp >= (char *)t->cold->stack &&
+        sp < (char *)t->cold->stack + t->cold->stack_size) {
+        *lo = t->cold->stack;
+        *hi = (char *)t->cold->stack + t->cold->stack_size;
+    } else if (carrier_stack && sp >= carrier_stack &&
+               sp < carrier_stack + CARRIER_STACK_SIZE) {
+        *lo = carrier_stack;
+        *hi = carrier_stack + CARRIER_STACK_SIZE;
+    } else if (sp >= main_stack_lo && sp < main_stack_hi) {
+        *lo = main_stack_lo;
+        *hi = main_stack_hi;
+    } else {
+        // Mid-switch or on an unknown stack: record the PC only
+        *lo = NULL;
+        *hi = NULL;
+    }
+}
+
+static void prof_handler(int sig, siginfo_t *info, void *ucontext) {
+    (void)sig;
+    (void)info;
+
+    unsigned head = atomic_load_explicit(&prof_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&prof_tail, memory_order_acquire);
+    if (prof_buffer == NULL || head - tail >= PROF_BUFFER_SAMPLES) {
+        atomic_fetch_add_explicit(&prof_dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    prof_sample_t *sample = &prof_buffer[head & (PROF_BUFFER_SAMPLES - 1)];
+    sample->tid = running_thread ? running_thread->tid : 0;
+    sample->depth = 0;
+
+    ucontext_t *uc = (ucontext_t *)ucontext;
+    uintptr_t pc, fp, sp;
+#if defined(__x86_64__)
+    pc = (uintptr_t)uc->uc_mcontext.gregs[REG_RIP];
+    fp = (uintptr_t)uc->uc_mcontext.gregs[REG_RBP];
+    sp = (uintptr_t)uc->uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+    pc = (uintptr_t)uc->uc_mcontext.pc;
+    fp = (uintptr_t)uc->uc_mcontext.regs[29];
+    sp = (uintptr_t)uc->uc_mcontext.sp;
+#else
+    (void)uc;
+    pc = fp = sp = 0;
+#endif
+
+    if (pc != 0) {
+        sample->ips[sample->depth++] = (void *)pc;
+    }
+
+    char *lo, *hi;
+    prof_stack_bounds((char *)sp, &lo, &hi);
+    while (sample->depth < PROF_MAX_DEPTH && lo != NULL &&
+           fp >= (uintptr_t)sp && fp >= (uintptr_t)lo &&
+           fp + 2 * sizeof(uintptr_t) <= (uintptr_t)hi &&
+           (fp & (sizeof(uintptr_t) - 1)) == 0) {
+        uintptr_t *frame = (uintptr_t *)fp;
+        if (frame[1] == 0) {
+            break;
+        }
+        sample->ips[sample->depth++] = (void *)frame[1];
+        if (frame[0] <= fp) {
+            break;
+        }
+        fp = frame[0];
+    }
+
+    atomic_store_explicit(&prof_head, head + 1, memory_order_release);
+}
+
+int uthread_prof_start(int hz) {
+    if (hz <= 0 || hz > 1000000) {
+        return -1;
+    }
+
+    // A tick inside the allocator would switch away holding its lock
+    block_signals();
+
+    if (prof_buffer == NULL) {
+        prof_buffer = calloc(PROF_BUFFER_SAMPLES, sizeof(prof_sample_t));
+        if (prof_buffer == NULL) {
+            unblock_signals();
+            return -1;
+        }
+    }
+
+    if (main_stack_lo == NULL) {
+        pthread_attr_t attr;
+        void *addr;
+        size_t size;
+        if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+            if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+                main_stack_lo = addr;
+                main_stack_hi = (char *)addr + size;
+            }
+            pthread_attr_destroy(&attr);
+        }
+    }
+
+    if (prof_altstack == NULL) {
+        size_t size = signal_frame_size() + PROF_HANDLER_STACK;
+        prof_altstack = malloc(size);
+        if (prof_altstack == NULL) {
+            unblock_signals();
+            return -1;
+        }
+        stack_t ss = { .ss_sp = prof_altstack, .ss_flags = 0, .ss_size = size };
+        if (sigaltstack(&ss, NULL) != 0) {
+            free(prof_altstack);
+            prof_altstack = NULL;
+            unblock_signals();
+            return -1;
+        }
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = prof_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaddset(&sa.sa_mask, SIGALRM); // Never switch uthreads mid-sample
+    sa.sa_flags = SA_RESTART | SA_SIGINFO | SA_ONSTACK;
+    int rc = sigaction(SIGPROF, &sa, NULL);
+    unblock_signals();
+    if (rc != 0) {
+        return -1;
+    }
+
+    struct itimerval prof_timer;
+    prof_timer.it_value.tv_sec = 0;
+    prof_timer.it_value.tv_usec = 1000000 / hz;
+    prof_timer.it_interval = prof_timer.it_value;
+    return setitimer(ITIMER_PROF, &prof_timer, NULL);
+}
+
+int uthread_prof_stop(void) {
+    struct itimerval prof_timer;
+    memset(&prof_timer, 0, sizeof(prof_timer));
+    return setitimer(ITIMER_PROF, &prof_timer, NULL);
+}
+
+static size_t prof_format_frame(char *buf, size_t len, void *ip) {
+    Dl_info info;
+    int found = dladdr(ip, &info);
+    int n;
+    if (found && info.dli_sname) {
+        n = snprintf(buf, len, ";%s", info.dli_sname);
+    } else if (found && info.dli_fname) {
+        const char *base = strrchr(info.dli_fname, '/');
+        n = snprintf(buf, len, ";%s+0x%lx", base ? base + 1 : info.dli_fname,
+                     (unsigned long)((char *)ip - (char *)info.dli_fbase));
+    } else {
+        n = snprintf(buf, len, ";0x%lx", (unsigned long)(uintptr_t)ip);
+    }
+    if (n < 0) {
+        return 0;
+    }
+    return (size_t)n < len ? (size_t)n : len - 1;
+}
+
+static int prof_line_cmp(const void *a, const void *b) {
+    const char *x = *(char *const *)a;
+    const char *y = *(char *const *)b;
+    if (x == NULL || y == NULL) {
+        return (x == NULL) - (y == NULL); // Failed strdups sort last
+    }
+    return strcmp(x, y);
+}
+
+// Drains the sample ring and writes one folded stack per line
+// ("uthread-<tid>;outer;...;leaf <count>"), as consumed by flamegraph.pl.
+int uthread_prof_dump(int fd) {
+    if (prof_buffer == NULL) {
+        return -1;
+    }
+
+    // Allocates and symbolizes, so a tick must not switch away mid-call
+    block_signals();
+
+    unsigned tail = atomic_load_explicit(&prof_tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&prof_head, memory_order_acquire);
+    unsigned count = head - tail;
+
+    char **lines = NULL;
+    if (count > 0) {
+        lines = calloc(count, sizeof(char *));
+        if (lines == NULL) {
+            unblock_signals();
+            return -1;
+        }
+    }
+
+    // Symbolize first so samples at different PCs of the same function fold
+    char buf[4096];
+    for (unsigned i = 0; i < count; i++) {
+        prof_sample_t *sample = &prof_buffer[(tail + i) & (PROF_BUFFER_SAMPLES - 1)];
+        size_t len = (size_t)snprintf(buf, sizeof(buf), "uthread-%d", sample->tid);
+        for (int d = sample->depth - 1; d >= 0; d--) {
+            len += prof_format_frame(buf + len, sizeof(buf) - len, sample->ips[d]);
+        }
+        lines[i] = strdup(buf);
+    }
+    atomic_store_explicit(&prof_tail, head, memory_order_release);
+
+    qsort(lines, count, sizeof(char *), prof_line_cmp);
+
+    for (unsigned i = 0; i < count; ) {
+        unsigned run = 1;
+        while (i + run < count && lines[i] && lines[i + run] &&
+               strcmp(lines[i], lines[i + run]) == 0) {
+            run++;
+        }
+        if (lines[i]) {
+            dprintf(fd, "%s %u\n", lines[i], run);
+        }
+        i += run;
+    }
+
+    unsigned dropped = atomic_exchange(&prof_dropped, 0);
+    if (dropped > 0) {
+        dprintf(fd, "# %u samples dropped\n", dropped);
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        free(lines[i]);
+    }
+    free(lines);
+    unblock_signals();
+    return (int)count;
+}
+
+// Live statistics
+//
+// The page is rewritten from timer_handler(), so the switch path only
+// pays for a counter increment. Blocked times are measured from the first
+// tick that saw the thread blocked. Lock tables count each lock once, from
+// the thread at the head of its wait list.
+
+static char stats_name[64];
+static uint64_t stats_window_ns = 0;    // Start of the switches/sec window
+static uint64_t stats_window_switches = 0;
+
+static struct {
+    int tid;
+    uint64_t since;             // 0 = not blocked at the last rewrite
+} stats_blocked[MAX_THREADS];
+
+static uint32_t stats_list_length(const thread_t *list) {
+    uint32_t n = 0;
+    for (; list != NULL; list = list->next) {
+        n++;
+    }
+    return n;
+}
+
+static uint32_t stats_kind(const thread_t *t, uint64_t *object) {
+    if (t->blocked_on) {
+        *object = (uint64_t)(uintptr_t)t->blocked_on;
+        return UTHREAD_STATS_MUTEX;
+    }
+    if (t->blocked_on_rw) {
+        *object = (uint64_t)(uintptr_t)t->blocked_on_rw;
+        return UTHREAD_STATS_RWLOCK;
+    }
+    if (t->blocked_on_future) {
+        *object = (uint64_t)(uintptr_t)t->blocked_on_future;
+        return UTHREAD_STATS_FUTURE;
+    }
+    if (t->waiting_for) {
+        *object = (uint64_t)(uintptr_t)t->waiting_for;
+        return UTHREAD_STATS_JOIN;
+    }
+    *object = 0;
+    return UTHREAD_STATS_OTHER;
+}
+
+// Waiters of the lock `t` waits on if `t` heads its wait list, else 0
+static uint32_t stats_lock_waiters(const thread_t *t) {
+    if (t->blocked_on && t->blocked_on->waiting_list == t) {
+        return stats_list_length(t->blocked_on->waiting_list);
+    }
+    rwlock_t *rw = t->blocked_on_rw;
+    if (rw && (rw->write_waiting == t || (rw->write_waiting == NULL && rw->read_waiting == t))) {
+        return stats_list_length(rw->write_waiting) + stats_list_length(rw->read_waiting);
+    }
+    return 0;
+}
+
+static void stats_publish(void) {
+    uthread_stats_page_t *page = stats_page;
+    uint64_t now = monotonic_ns();
+
+    __atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    page->updated_ns = now;
+    page->switches = stats_switches;
+    if (now - stats_window_ns >= 1000000000ULL) {
+        page->switches_per_sec = (stats_switches - stats_window_switches) * 1000000000ULL /
+                                 (now - stats_window_ns);
+        stats_window_ns = now;
+        stats_window_switches = stats_switches;
+    }
+
+    uint32_t ready = 0;
+    for (int g = 0; g < group_count; g++) {
+        ready += stats_list_length(groups[g].head);
+    }
+    page->ready = ready;
+    page->live = thread_count;
+    memset(page->blocked, 0, sizeof(page->blocked));
+    page->nlocks = 0;
+    page->nthreads = 0;
+
+    for (int i = 0; i < MAX_THREADS; i++) {
+        thread_t *t = &threads[i];
+        if ((i > 0 && t->tid == 0) || t->state != THREAD_BLOCKED) {
+            stats_blocked[i].since = 0;
+            continue;
+        }
+        if (stats_blocked[i].since == 0 || stats_blocked[i].tid != t->tid) {
+            stats_blocked[i].tid = t->tid;
+            stats_blocked[i].since = now;
+        }
+
+        uint64_t object;
+        uint32_t kind = stats_kind(t, &object);
+        page->blocked[kind]++;
+
+        // Insertion into the longest-blocked table, longest first
+        uint64_t blocked_ns = now - stats_blocked[i].since;
+        uint32_t n = page->nthreads;
+        uint32_t pos = n;
+        while (pos > 0 && page->longest[pos - 1].blocked_ns < blocked_ns) {
+            pos--;
+        }
+        if (pos < UTHREAD_STATS_TOP) {
+            if (n == UTHREAD_STATS_TOP) {
+                n--;
+            }
+            memmove(&page->longest[pos + 1], &page->longest[pos],
+                    (n - pos) * sizeof(page->longest[0]));
+            page->longest[pos] = (uthread_stats_thread_t){ t->tid, kind, object, blocked_ns };
+            page->nthreads = n + 1;
+        }
+
+        uint32_t waiters = stats_lock_waiters(t);
+        if (waiters == 0) {
+            continue;
+        }
+        n = page->nlocks;
+        pos = n;
+        while (pos > 0 && page->locks[pos - 1].waiters < waiters) {
+            pos--;
+        }
+        if (pos < UTHREAD_STATS_TOP) {
+            if (n == UTHREAD_STATS_TOP) {
+                n--;
+            }
+            memmove(&page->locks[pos + 1], &page->locks[pos],
+                    (n - pos) * sizeof(page->locks[0]));
+            page->locks[pos] = (uthread_stats_lock_t){ object, kind, waiters };
+            page->nlocks = n + 1;
+        }
+    }
+
+    __atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELEASE);
+}
+
+int uthread_stats_publish(const char *name) {
+    block_signals();
+
+    if (!scheduler_initialized) {
+        scheduler_init();
+    }
+
+    if (stats_page != NULL) {
+        unblock_signals();
+        errno = EBUSY;
+        return -1;
+    }
+
+    if (name == NULL) {
+        snprintf(stats_name, sizeof(stats_name), "/uthread-%d", (int)getpid());
+    } else if (name[0] != '/' || strlen(name) >= sizeof(stats_name)) {
+        unblock_signals();
+        errno = EINVAL;
+        return -1;
+    } else {
+        strcpy(stats_name, name);
+    }
+
+    int fd = shm_open(stats_name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0) {
+        unblock_signals();
+        return -1;
+    }
+    void *page = MAP_FAILED;
+    if (ftruncate(fd, sizeof(uthread_stats_page_t)) == 0) {
+        page = mmap(NULL, sizeof(uthread_stats_page_t), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (page == MAP_FAILED) {
+        shm_unlink(stats_name);
+        unblock_signals();
+        return -1;
+    }
+
+    stats_page = page;
+    stats_page->magic = UTHREAD_STATS_MAGIC;
+    stats_page->version = UTHREAD_STATS_VERSION;
+    stats_page->pid = (int32_t)getpid();
+    stats_window_ns = monotonic_ns();
+    stats_window_switches = stats_switches;
+    stats_publish();
+
+    unblock_signals();
+    return 0;
+}
+
+int uthread_stats_unpublish(void) {
+    block_signals();
+
+    if (stats_page == NULL) {
+        unblock_signals();
+        errno = EINVAL;
+        return -1;
+    }
+    munmap(stats_page, sizeof(uthread_stats_page_t));
+    stats_page = NULL;
+    int rc = shm_unlink(stats_name);
+
+    unblock_signals();
+    return rc;
+}
@@ -4,6 +4,12 @@
 #include <ucontext.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 // Thread states
 typedef enum {
@@ -13,28 +19,202 @@ typedef enum {
     THREAD_TERMINATED
 } thread_state_t;
 
-// Thread structure
-typedef struct thread {
-    int tid;                    // Thread ID
-    ucontext_t context;         // Thread context
-    thread_state_t state;       // Thread state
+#define UTHREAD_MAX_READ_HOLDS 4   // Read locks a thread may hold at once
+#define UTHREAD_LOCKDEP_DEPTH 16   // Locks tracked per thread by lockdep
+#define UTHREAD_KEYS_INLINE 8      // TLS values stored inside thread_t
+#define UTHREAD_KEYS_MAX 128       // Total TLS keys
+#define UTHREAD_DESTRUCTOR_ITERATIONS 4
+
+typedef unsigned int uthread_key_t;
+
+// Future: a value produced by a uthread (uthread_async) or set by hand
+// (promise). Opaque; any number of uthreads may await it.
+typedef struct uthread_future uthread_future_t;
+
+// Dependency graph of short functions run by uthread_graph_run(). Opaque.
+typedef struct uthread_graph uthread_graph_t;
+
+// How a blocking call reacts when it would close a wait-for cycle
+typedef enum {
+    DEADLOCK_IGNORE,            // Block anyway, no check
+    DEADLOCK_REPORT,            // Print the cycle, then block
+    DEADLOCK_FAIL               // Fail the call with EDEADLK
+} deadlock_policy_t;
+
+// How uthread stacks are sized
+typedef enum {
+    UTHREAD_STACK_FIXED,        // Every stack has the default size
+    UTHREAD_STACK_PROFILE,      // Default size, high-water marks recorded
+    UTHREAD_STACK_LEARN         // Sized from the start routine's record
+} uthread_stack_policy_t;
+
+// Read-lock hold record (one per rwlock a thread holds for reading)
+typedef struct rw_reader {
+    struct thread *thread;      // Holding thread
+    struct rw_reader *next;     // Next reader of the same rwlock
+} rw_reader_t;
+
+// Execution kind of a schedulable entity
+typedef enum {
+    THREAD_KIND_STACKFUL,       // Own stack and saved context
+    THREAD_KIND_TASK            // Stackless task run on the carrier stack
+} thread_kind_t;
+
+#define UTHREAD_CACHE_LINE 64       // Size of a thread_t header
+
+// Saved execution context. The x86-64 switch pushes the callee-saved
+// registers onto the thread's own stack, so only the stack pointer is
+// kept; other targets (or -DUTHREAD_UCONTEXT) use ucontext.
+#if defined(__x86_64__) && !defined(UTHREAD_UCONTEXT)
+#define UTHREAD_FAST_SWITCH 1
+typedef struct uthread_ctx {
+    void *sp;                   // Stack pointer at the last switch
+} uthread_ctx_t;
+#else
+typedef struct uthread_ctx {
+    ucontext_t uc;
+} uthread_ctx_t;
+#endif
+
+// FP state kept across switches, for uthread_attr_setfpstate()
+enum {
+    UTHREAD_FP_LAZY,            // Control words only; enough for compiled code
+    UTHREAD_FP_FULL             // Also every vector/x87 register (fxsave)
+};
+
+// Worker sets for uthread_attr_setaffinity(): bit n stands for worker n.
+// There is one worker today, the kernel thread running the scheduler.
+#define UTHREAD_WORKER_ALL (~0UL)
+
+// Weight of the default group 0, which main and ungrouped uthreads are in
+#define UTHREAD_GROUP_WEIGHT_DEFAULT 100
+
+// Thread creation attributes, set up by uthread_attr_init()
+typedef struct uthread_attr {
+    int fp_state;               // UTHREAD_FP_LAZY or UTHREAD_FP_FULL
+    unsigned long workers;      // Workers the thread may run on
+    bool has_sigmask;           // Run with sigmask instead of the default
+    sigset_t sigmask;           // Own signal mask (SIGALRM is managed)
+    int group;                  // Thread group, 0 = default
+} uthread_attr_t;
+
+#ifdef UTHREAD_LOCKDEP
+// Locks held by one thread or task, in acquisition order
+typedef struct lockdep_held {
+    int count;                  // Entries in classes/locks
+    int classes[UTHREAD_LOCKDEP_DEPTH]; // Lock classes held, in order
+    void *locks[UTHREAD_LOCKDEP_DEPTH]; // Matching lock addresses
+} lockdep_held_t;
+#endif
+
+// Cold per-thread state: only touched when the thread itself runs or
+// is switched to, so it lives apart from the header
+typedef struct thread_cold {
+    uthread_ctx_t context;      // Thread context
+    void *fp_area;              // fxsave image, UTHREAD_FP_FULL threads only
+    bool has_sigmask;           // Installs sigmask while running
+    sigset_t sigmask;           // Own signal mask
     void *stack;                // Stack pointer
+    unsigned char stack_source; // Own guarded mapping or arena slot
+    bool stack_painted;         // Painted whole, measured when reaped
     size_t stack_size;          // Stack size
     void *retval;               // Return value
     void (*start_routine)(void *); // Thread start function
     void *arg;                  // Thread argument
+    rw_reader_t read_holds[UTHREAD_MAX_READ_HOLDS]; // Read locks held
+    bool tls_used;              // Set once a non-NULL TLS value is stored
+    void *tls_inline[UTHREAD_KEYS_INLINE]; // Values of keys below UTHREAD_KEYS_INLINE
+    void **tls_overflow;        // Values of the remaining keys (lazily allocated)
+    int rcu_nesting;            // uthread_rcu_read_lock() depth
+    unsigned long rcu_qs;       // Grace period of the last quiescent state
+#ifdef UTHREAD_LOCKDEP
+    lockdep_held_t held;        // Lockdep held-lock stack
+#endif
+} thread_cold_t;
+
+// Thread header: everything the scheduler, the wait-for graph and queue
+// walks look at, packed into exactly one cache line
+typedef struct thread {
+    int tid;                    // Thread ID
+    thread_state_t state;       // Thread state
+    unsigned wfg_mark;          // Wait-for graph traversal mark
+    unsigned char kind;         // thread_kind_t
+    bool is_writer;            // For RW locks: true if waiting for write lock
+    unsigned char group;        // Thread group the thread is scheduled in
     struct thread *next;        // Next thread in queue
     struct thread *waiting_for; // Thread waiting for this thread (for join)
     struct mutex *blocked_on;   // Mutex this thread is blocked on
     struct rwlock *blocked_on_rw; // RW lock this thread is blocked on
-    bool is_writer;            // For RW locks: true if waiting for write lock
+    struct uthread_future *blocked_on_future; // Future this thread awaits
+    thread_cold_t *cold;        // Context, stack and TLS; NULL for tasks
 } thread_t;
 
+// Stackless tasks
+//
+// A task is a step function that runs to its next suspension point on the
+// carrier stack and returns; locals do not survive a suspension, so keep
+// state in the argument. Use the UTHREAD_TASK_* macros for suspension
+// (protothread style, hence no `switch` of your own across them).
+// Tasks cannot join, await, take rwlocks, use TLS or call uthread_exit().
+typedef struct uthread_task {
+    thread_t thread;            // Scheduling header, must come first
+    int resume_point;           // Where UTHREAD_TASK_BEGIN resumes
+    int (*fn)(struct uthread_task *task, void *arg); // Step function
+    void *arg;                  // Step function argument
+#ifdef UTHREAD_LOCKDEP
+    lockdep_held_t *held;       // Lockdep held-lock stack, from the first lock
+#endif
+} uthread_task_t;
+
+#define UTHREAD_TASK_SIZE sizeof(uthread_task_t) // Bytes per task
+
+enum {
+    UTHREAD_TASK_DONE,          // Task finished and is freed
+    UTHREAD_TASK_YIELDED,       // Requeue at the back of the ready queue
+    UTHREAD_TASK_BLOCKED        // Parked on a wait list
+};
+
+#define UTHREAD_TASK_BEGIN(task) switch ((task)->resume_point) { case 0:
+
+#define UTHREAD_TASK_END(task) \
+    } (task)->resume_point = 0; return UTHREAD_TASK_DONE
+
+#define UTHREAD_TASK_YIELD(task) \
+    do { \
+        (task)->resume_point = __LINE__; \
+        return UTHREAD_TASK_YIELDED; \
+        case __LINE__:; \
+    } while (0)
+
+// Ownership is handed over while parked; a failed lock ends the task
+#define UTHREAD_TASK_LOCK(task, mutex) \
+    do { \
+        int uthread_lock_rc_ = uthread_task_mutex_lock((task), (mutex)); \
+        if (uthread_lock_rc_ < 0) { \
+            (task)->resume_point = 0; \
+            return UTHREAD_TASK_DONE; \
+        } \
+        if (uthread_lock_rc_ > 0) { \
+            (task)->resume_point = __LINE__; \
+            return UTHREAD_TASK_BLOCKED; \
+            case __LINE__:; \
+        } \
+    } while (0)
+
+// Deferred callback for uthread_call_rcu(); embed it in the object
+typedef struct uthread_rcu_head {
+    struct uthread_rcu_head *next;
+    void (*func)(struct uthread_rcu_head *head);
+} uthread_rcu_head_t;
+
 // Mutex structure
 typedef struct mutex {
     int locked;                 // 0 = unlocked, 1 = locked
     thread_t *owner;             // Thread that owns the mutex
     thread_t *waiting_list;     // List of threads waiting for this mutex
+#ifdef UTHREAD_LOCKDEP
+    int lock_class;             // Lockdep class (init site), 0 = untracked
+#endif
 } mutex_t;
 
 // Read-write lock structure
@@ -43,15 +223,123 @@ typedef struct rwlock {
     thread_t *writer;           // Current writer thread (NULL if none)
     thread_t *read_waiting;     // Readers waiting
     thread_t *write_waiting;    // Writers waiting
-    thread_t *readers_list;     // List of threads holding read lock
+    rw_reader_t *readers_list;  // Hold records of threads holding read lock
+#ifdef UTHREAD_LOCKDEP
+    int lock_class;             // Lockdep class (init site), 0 = untracked
+#endif
 } rwlock_t;
 
+// Sequence lock: readers retry instead of writing shared state, writers
+// serialise on the embedded mutex
+typedef struct uthread_seqlock {
+    unsigned seq;               // Odd while a writer is inside
+    mutex_t lock;               // Serialises writers
+} uthread_seqlock_t;
+
 // Thread functions
 int uthread_create(void (*start_routine)(void *), void *arg);
+int uthread_create_attr(const uthread_attr_t *attr,
+                        void (*start_routine)(void *), void *arg);
+// Builds the thread's argument in arg_size bytes at the top of its own
+// stack (16-byte aligned; EINVAL above 4 KB, half a default stack):
+// construct(arg, ctx) runs before the thread is queued, with preemption
+// masked, and start_routine then gets arg. The argument is gone once
+// start_routine returns.
+int uthread_create_inplace(const uthread_attr_t *attr, void (*start_routine)(void *),
+                           size_t arg_size, void (*construct)(void *arg, void *ctx),
+                           void *ctx);
 int uthread_join(int tid, void **retval);
 void uthread_exit(void *retval);
 int uthread_self(void);
 
+// Thread attribute functions
+int uthread_attr_init(uthread_attr_t *attr);
+int uthread_attr_setfpstate(uthread_attr_t *attr, int fp_state);
+int uthread_attr_setsigmask(uthread_attr_t *attr, const sigset_t *mask);
+int uthread_attr_setaffinity(uthread_attr_t *attr, unsigned long workers);
+int uthread_attr_setgroup(uthread_attr_t *attr, int group);
+
+// Thread group functions. Groups with ready threads share the CPU in
+// proportion to their weight (group 0 has UTHREAD_GROUP_WEIGHT_DEFAULT),
+// whatever their thread counts; within a group threads run FIFO. Once a
+// group has max_threads live uthreads (0 = no limit), creating another in
+// it fails with EAGAIN. Returns the new group's id.
+int uthread_group_create(unsigned weight, int max_threads);
+
+// Worker placement functions
+int uthread_worker_pin(int cpu);
+int uthread_worker_node(void);
+
+// Stack arena. Call before creating any uthread: descriptors and stacks
+// of the first `slots` thread slots are then carved out of 2 MB pages,
+// and each stack is kept for the next thread created in its slot.
+int uthread_arena_init(size_t slots);
+bool uthread_arena_hugetlb(void);
+
+// Stack profiling. Unless the policy is UTHREAD_STACK_FIXED, new stacks
+// are painted whole and their high-water mark is recorded per start
+// routine when the thread exits. UTHREAD_STACK_LEARN gives later threads
+// of a routine the smallest power-of-two size from 4 KB to 64 KB that
+// holds its peak plus headroom for a signal frame as this process takes
+// them (measured at startup); arena stacks keep their slot size.
+// uthread_stack_size_for() tells what a new thread of the routine would
+// get; uthread_stack_dump() writes one line per routine.
+void uthread_set_stack_policy(uthread_stack_policy_t policy);
+size_t uthread_stack_size_for(void (*start_routine)(void *));
+int uthread_stack_dump(int fd);
+
+// Stackless task functions
+int uthread_task_create(int (*fn)(uthread_task_t *task, void *arg), void *arg);
+int uthread_task_mutex_lock(uthread_task_t *task, mutex_t *mutex);
+
+// Future functions
+uthread_future_t *uthread_async(void *(*fn)(void *), void *arg);
+uthread_future_t *uthread_promise_create(void);
+int uthread_promise_set(uthread_future_t *future, void *value);
+int uthread_await(uthread_future_t *future, void **value);
+bool uthread_future_ready(const uthread_future_t *future);
+uthread_future_t *uthread_when_all(uthread_future_t **futures, int count);
+uthread_future_t *uthread_when_any(uthread_future_t **futures, int count);
+void uthread_future_release(uthread_future_t *future);
+
+// Data-parallel functions. Bodies and graph nodes run on stackless
+// helper tasks as well as on the caller, so they must not block.
+int uthread_parallel_for(size_t begin, size_t end, size_t grain,
+                         void (*fn)(size_t begin, size_t end, void *ctx), void *ctx);
+uthread_graph_t *uthread_graph_create(void);
+int uthread_graph_add(uthread_graph_t *graph, void (*fn)(void *), void *arg);
+int uthread_graph_depend(uthread_graph_t *graph, int node, int before);
+int uthread_graph_run(uthread_graph_t *graph);
+void uthread_graph_destroy(uthread_graph_t *graph);
+
+// Uthread-local storage functions
+int uthread_key_create(uthread_key_t *key, void (*destructor)(void *));
+int uthread_key_delete(uthread_key_t key);
+void *uthread_getspecific(uthread_key_t key);
+int uthread_setspecific(uthread_key_t key, const void *value);
+
+// Read-copy-update functions. Read-side sections may be preempted but
+// should not block, which would hold up every grace period; tasks must
+// not suspend inside one.
+void uthread_rcu_read_lock(void);
+void uthread_rcu_read_unlock(void);
+int uthread_synchronize_rcu(void);
+int uthread_call_rcu(uthread_rcu_head_t *head, void (*func)(uthread_rcu_head_t *head));
+
+#define uthread_rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_CONSUME)
+#define uthread_rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+// Wait-on-address functions, for primitives that only enter the scheduler
+// on contention. uthread_wait() blocks while *addr == expected (timeout is
+// relative, NULL waits forever) and fails with EAGAIN if it already
+// differs; uthread_wake() wakes up to n waiters on addr, oldest first, and
+// returns how many it woke. Not for tasks. While every thread, main
+// included, is blocked, the scheduler sleeps until the earliest timeout;
+// with none timed, a wait by main fails with EDEADLK and any other such
+// stall aborts with a deadlock report.
+int uthread_wait(const unsigned *addr, unsigned expected, const struct timespec *timeout);
+int uthread_wake(const unsigned *addr, int n);
+
 // Mutex functions
 int uthread_mutex_init(mutex_t *mutex);
 int uthread_mutex_lock(mutex_t *mutex);
@@ -64,10 +352,68 @@ int uthread_rwlock_wrlock(rwlock_t *rwlock);
 int uthread_rwlock_unlock(rwlock_t *rwlock);
 int uthread_rwlock_destroy(rwlock_t *rwlock);
 
+// Sampling profiler functions
+int uthread_prof_start(int hz);
+int uthread_prof_stop(void);
+int uthread_prof_dump(int fd);
+
+// Live statistics. Maps a shared memory segment (shm_open name, or
+// "/uthread-<pid>" if NULL) and rewrites a snapshot into it on every
+// preemption tick; see uthread_stats.h for the layout and the read side,
+// and the uthread_stat tool. Unpublishing also unlinks the segment.
+int uthread_stats_publish(const char *name);
+int uthread_stats_unpublish(void);
+
 // Internal scheduler functions
 void scheduler_init(void);
 void scheduler_yield(void);
 void scheduler_schedule(void);
 void deadlock_detect(void);
+void uthread_set_deadlock_policy(deadlock_policy_t policy);
+
+// Sequence lock functions. Read side:
+//
+//     unsigned seq;
+//     do {
+//         seq = uthread_read_seqbegin(&sl);
+//         copy = shared;
+//     } while (uthread_read_seqretry(&sl, seq));
+//
+// Not for tasks, which cannot yield to a preempted writer.
+int uthread_seqlock_init(uthread_seqlock_t *sl);
+int uthread_write_seqlock(uthread_seqlock_t *sl);
+int uthread_write_sequnlock(uthread_seqlock_t *sl);
+
+static inline unsigned uthread_read_seqbegin(const uthread_seqlock_t *sl) {
+    unsigned seq;
+    // A writer is inside and was preempted: let it finish
+    while ((seq = __atomic_load_n(&sl->seq, __ATOMIC_ACQUIRE)) & 1) {
+        scheduler_yield();
+    }
+    return seq;
+}
+
+static inline bool uthread_read_seqretry(const uthread_seqlock_t *sl, unsigned seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&sl->seq, __ATOMIC_RELAXED) != seq;
+}
+
+// Lock-order validator (build everything with -DUTHREAD_LOCKDEP).
+// Locks are grouped into classes by the source line that initialised
+// them; every "B taken while holding A" is recorded, and the first
+// acquisition contradicting a recorded order is reported.
+#ifdef UTHREAD_LOCKDEP
+int uthread_mutex_init_site(mutex_t *mutex, const char *file, int line);
+int uthread_rwlock_init_site(rwlock_t *rwlock, const char *file, int line);
+int uthread_seqlock_init_site(uthread_seqlock_t *sl, const char *file, int line);
+int uthread_lockdep_reports(void);
+#define uthread_mutex_init(mutex) uthread_mutex_init_site((mutex), __FILE__, __LINE__)
+#define uthread_rwlock_init(rwlock) uthread_rwlock_init_site((rwlock), __FILE__, __LINE__)
+#define uthread_seqlock_init(sl) uthread_seqlock_init_site((sl), __FILE__, __LINE__)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif // UTHREAD_H
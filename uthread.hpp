@@ -0,0 +1,249 @@
+#ifndef UTHREAD_HPP
+#define UTHREAD_HPP
+
+// C++17 layer over uthread.h, header only.
+//
+//     auto t = uthread::spawn([data] { return sum(data); });
+//     int total = t.join();
+//
+// spawn() moves the callable and its arguments into a frame at the top of
+// the new uthread's stack, so it allocates nothing beyond the stack. The
+// result also stays on that stack until join() moves it out: a finished
+// uthread waits for its joiner before exiting. Handles are move-only and
+// join in their destructor if still joinable. An exception escaping the
+// callable terminates the program, as it would with std::thread.
+
+#include "uthread.h"
+#include <cerrno>
+#include <new>
+#include <system_error>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace uthread {
+
+namespace detail {
+
+[[noreturn]] inline void throw_errno(const char *what) {
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+enum : unsigned {
+    RUNNING,
+    RESULT_READY,               // Result constructed, waiting for join()
+    RESULT_TAKEN                // Moved out; the uthread may exit
+};
+
+template <class R>
+struct result_slot {
+    unsigned state = RUNNING;
+    alignas(R) unsigned char storage[sizeof(R)];
+
+    R *get() { return std::launder(reinterpret_cast<R *>(storage)); }
+
+    // Runs on the uthread
+    template <class Call>
+    void produce(Call &&call) {
+        ::new (static_cast<void *>(storage)) R(call());
+        __atomic_store_n(&state, RESULT_READY, __ATOMIC_RELEASE);
+        uthread_wake(&state, 1);
+        while (__atomic_load_n(&state, __ATOMIC_ACQUIRE) != RESULT_TAKEN) {
+            uthread_wait(&state, RESULT_READY, nullptr);
+        }
+        get()->~R();
+    }
+
+    // Runs on the joiner
+    R take() {
+        while (__atomic_load_n(&state, __ATOMIC_ACQUIRE) == RUNNING) {
+            uthread_wait(&state, RUNNING, nullptr);
+        }
+        R value(std::move(*get()));
+        __atomic_store_n(&state, RESULT_TAKEN, __ATOMIC_RELEASE);
+        uthread_wake(&state, 1);
+        return value;
+    }
+};
+
+template <>
+struct result_slot<void> {
+    template <class Call>
+    void produce(Call &&call) {
+        call();
+    }
+};
+
+// What spawn() places on the new stack
+template <class Fn, class... Args>
+struct frame {
+    using result_type = std::invoke_result_t<Fn, Args...>;
+
+    Fn fn;
+    std::tuple<Args...> args;
+    result_slot<result_type> result;
+
+    template <class F, class... A>
+    explicit frame(F &&f, A &&...a) : fn(std::forward<F>(f)), args(std::forward<A>(a)...) {}
+
+    static void run(void *arg) noexcept {
+        frame *self = static_cast<frame *>(arg);
+        self->result.produce([self]() -> result_type {
+            return std::apply(std::move(self->fn), std::move(self->args));
+        });
+        self->~frame();
+    }
+};
+
+// References to spawn()'s arguments, and where the frame was built
+template <class Refs>
+struct construct_ctx {
+    Refs refs;
+    void *frame;
+};
+
+// construct callback of uthread_create_inplace()
+template <class Frame, class Ctx>
+void construct(void *arg, void *ctx) noexcept {
+    Ctx *c = static_cast<Ctx *>(ctx);
+    c->frame = arg;
+    std::apply([arg](auto &&...refs) {
+        ::new (arg) Frame(std::forward<decltype(refs)>(refs)...);
+    }, std::move(c->refs));
+}
+
+template <class F, class... Args>
+using enable_if_callable = std::enable_if_t<
+    std::is_invocable_v<std::decay_t<F>, std::decay_t<Args>...>>;
+
+} // namespace detail
+
+// Move-only handle to a uthread returning R
+template <class R>
+class thread {
+public:
+    thread() noexcept = default;
+    thread(int tid, detail::result_slot<R> *result) noexcept : tid_(tid), result_(result) {}
+
+    thread(thread &&other) noexcept
+        : tid_(std::exchange(other.tid_, 0)), result_(std::exchange(other.result_, nullptr)) {}
+
+    thread &operator=(thread &&other) noexcept {
+        if (this != &other) {
+            if (joinable()) {
+                join();
+            }
+            tid_ = std::exchange(other.tid_, 0);
+            result_ = std::exchange(other.result_, nullptr);
+        }
+        return *this;
+    }
+
+    thread(const thread &) = delete;
+    thread &operator=(const thread &) = delete;
+
+    ~thread() {
+        if (joinable()) {
+            join();
+        }
+    }
+
+    bool joinable() const noexcept { return tid_ > 0; }
+    int id() const noexcept { return tid_; }
+
+    R join() {
+        if (!joinable()) {
+            errno = EINVAL;
+            detail::throw_errno("uthread::thread::join");
+        }
+        int tid = std::exchange(tid_, 0);
+        if constexpr (std::is_void_v<R>) {
+            uthread_join(tid, nullptr);
+        } else {
+            R value = result_->take();
+            uthread_join(tid, nullptr);
+            return value;
+        }
+    }
+
+private:
+    int tid_ = 0;
+    detail::result_slot<R> *result_ = nullptr;
+};
+
+template <class F, class... Args, class = detail::enable_if_callable<F, Args...>>
+auto spawn(const uthread_attr_t &attr, F &&f, Args &&...args) {
+    using frame_t = detail::frame<std::decay_t<F>, std::decay_t<Args>...>;
+    using ctx_t = detail::construct_ctx<std::tuple<F &&, Args &&...>>;
+    static_assert(alignof(frame_t) <= 16, "callable is over-aligned for a uthread stack");
+
+    ctx_t ctx{ {std::forward<F>(f), std::forward<Args>(args)...}, nullptr };
+    int tid = uthread_create_inplace(&attr, &frame_t::run, sizeof(frame_t),
+                                     &detail::construct<frame_t, ctx_t>, &ctx);
+    if (tid < 0) {
+        detail::throw_errno("uthread::spawn");
+    }
+    // A void uthread may already be gone; its slot is never touched
+    auto *frame = static_cast<frame_t *>(ctx.frame);
+    return thread<typename frame_t::result_type>(tid, &frame->result);
+}
+
+template <class F, class... Args, class = detail::enable_if_callable<F, Args...>>
+auto spawn(F &&f, Args &&...args) {
+    uthread_attr_t attr;
+    uthread_attr_init(&attr);
+    return spawn(attr, std::forward<F>(f), std::forward<Args>(args)...);
+}
+
+// Scoped lock holders; a failed acquisition (e.g. EDEADLK) throws
+class mutex_guard {
+public:
+    explicit mutex_guard(mutex_t &mutex) : mutex_(mutex) {
+        if (uthread_mutex_lock(&mutex_) != 0) {
+            detail::throw_errno("uthread_mutex_lock");
+        }
+    }
+    ~mutex_guard() { uthread_mutex_unlock(&mutex_); }
+
+    mutex_guard(const mutex_guard &) = delete;
+    mutex_guard &operator=(const mutex_guard &) = delete;
+
+private:
+    mutex_t &mutex_;
+};
+
+class read_guard {
+public:
+    explicit read_guard(rwlock_t &rwlock) : rwlock_(rwlock) {
+        if (uthread_rwlock_rdlock(&rwlock_) != 0) {
+            detail::throw_errno("uthread_rwlock_rdlock");
+        }
+    }
+    ~read_guard() { uthread_rwlock_unlock(&rwlock_); }
+
+    read_guard(const read_guard &) = delete;
+    read_guard &operator=(const read_guard &) = delete;
+
+private:
+    rwlock_t &rwlock_;
+};
+
+class write_guard {
+public:
+    explicit write_guard(rwlock_t &rwlock) : rwlock_(rwlock) {
+        if (uthread_rwlock_wrlock(&rwlock_) != 0) {
+            detail::throw_errno("uthread_rwlock_wrlock");
+        }
+    }
+    ~write_guard() { uthread_rwlock_unlock(&rwlock_); }
+
+    write_guard(const write_guard &) = delete;
+    write_guard &operator=(const write_guard &) = delete;
+
+private:
+    rwlock_t &rwlock_;
+};
+
+} // namespace uthread
+
+#endif // UTHREAD_HPP
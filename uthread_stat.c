@@ -0,0 +1,109 @@
+#define _POSIX_C_SOURCE 200809L
+#include "uthread_stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+// Prints the live statistics page of a process that called
+// uthread_stats_publish(). Reads shared memory only, so the process being
+// watched is never stopped or signalled.
+// Usage: uthread_stat <pid | /name> [interval_ms]
+
+static const char *kind_names[UTHREAD_STATS_KINDS] = {
+    "mutex", "rwlock", "future", "join", "other"
+};
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void print_snapshot(const uthread_stats_page_t *s) {
+    uint64_t now = monotonic_ns();
+    uint64_t age_ms = now > s->updated_ns ? (now - s->updated_ns) / 1000000 : 0;
+
+    printf("pid %d  live %u  ready %u  switches %llu (%llu/s)  age %llu ms\n",
+           s->pid, s->live, s->ready, (unsigned long long)s->switches,
+           (unsigned long long)s->switches_per_sec, (unsigned long long)age_ms);
+
+    printf("blocked:");
+    for (int k = 0; k < UTHREAD_STATS_KINDS; k++) {
+        printf(" %s %u", kind_names[k], s->blocked[k]);
+    }
+    printf("\n");
+
+    if (s->nlocks > 0) {
+        printf("most waited-on locks:\n");
+        for (uint32_t i = 0; i < s->nlocks && i < UTHREAD_STATS_TOP; i++) {
+            const uthread_stats_lock_t *l = &s->locks[i];
+            printf("  %-7s 0x%llx  %u waiters\n",
+                   kind_names[l->kind < UTHREAD_STATS_KINDS ? l->kind : UTHREAD_STATS_OTHER],
+                   (unsigned long long)l->object, l->waiters);
+        }
+    }
+
+    if (s->nthreads > 0) {
+        printf("longest blocked:\n");
+        for (uint32_t i = 0; i < s->nthreads && i < UTHREAD_STATS_TOP; i++) {
+            const uthread_stats_thread_t *t = &s->longest[i];
+            printf("  tid %-6d %-7s 0x%llx  %llu ms\n", t->tid,
+                   kind_names[t->kind < UTHREAD_STATS_KINDS ? t->kind : UTHREAD_STATS_OTHER],
+                   (unsigned long long)t->object,
+                   (unsigned long long)(t->blocked_ns / 1000000));
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s <pid | /name> [interval_ms]\n", argv[0]);
+        return 2;
+    }
+
+    char name[64];
+    if (isdigit((unsigned char)argv[1][0])) {
+        snprintf(name, sizeof(name), "/uthread-%s", argv[1]);
+    } else {
+        snprintf(name, sizeof(name), "%s", argv[1]);
+    }
+    long interval_ms = argc == 3 ? atol(argv[2]) : 0;
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", name, strerror(errno));
+        return 1;
+    }
+    const uthread_stats_page_t *page = mmap(NULL, sizeof(*page), PROT_READ,
+                                            MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        fprintf(stderr, "%s: %s\n", name, strerror(errno));
+        return 1;
+    }
+
+    for (;;) {
+        uthread_stats_page_t snapshot;
+        if (!uthread_stats_read(page, &snapshot, 1000000)) {
+            fprintf(stderr, "%s: no consistent uthread stats page\n", name);
+            return 1;
+        }
+        print_snapshot(&snapshot);
+        if (interval_ms <= 0) {
+            break;
+        }
+        printf("\n");
+        fflush(stdout);
+        struct timespec delay = { interval_ms / 1000, (interval_ms % 1000) * 1000000L };
+        nanosleep(&delay, NULL);
+    }
+
+    munmap((void *)page, sizeof(*page));
+    return 0;
+}
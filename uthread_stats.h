@@ -0,0 +1,88 @@
+#ifndef UTHREAD_STATS_H
+#define UTHREAD_STATS_H
+
+// Layout of the live statistics page published by uthread_stats_publish().
+// Shared with readers in other processes (see uthread_stat.c), so only
+// fixed-width fields. The runtime rewrites the page on each preemption
+// tick, bumping seq to odd before and to even after; readers copy it and
+// retry if seq moved, as with uthread_seqlock_t.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define UTHREAD_STATS_MAGIC 0x75746873u  // "uths"
+#define UTHREAD_STATS_VERSION 1
+#define UTHREAD_STATS_TOP 8             // Entries in the top-N tables
+
+// What a blocked uthread waits for
+enum {
+    UTHREAD_STATS_MUTEX,
+    UTHREAD_STATS_RWLOCK,
+    UTHREAD_STATS_FUTURE,
+    UTHREAD_STATS_JOIN,
+    UTHREAD_STATS_OTHER,        // Wait-on-address, RCU grace periods
+    UTHREAD_STATS_KINDS
+};
+
+// A lock with waiters
+typedef struct uthread_stats_lock {
+    uint64_t object;            // Address in the publishing process
+    uint32_t kind;              // UTHREAD_STATS_MUTEX or _RWLOCK
+    uint32_t waiters;
+} uthread_stats_lock_t;
+
+// A blocked uthread
+typedef struct uthread_stats_thread {
+    int32_t tid;
+    uint32_t kind;
+    uint64_t object;            // What it waits for, 0 if nothing named
+    uint64_t blocked_ns;        // Since first seen blocked, tick resolution
+} uthread_stats_thread_t;
+
+typedef struct uthread_stats_page {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;               // Odd while the page is being rewritten
+    int32_t pid;
+    uint64_t updated_ns;        // CLOCK_MONOTONIC of the last rewrite
+    uint64_t switches;          // Context switches since start
+    uint64_t switches_per_sec;  // Over the last full second
+    uint32_t ready;             // Run-queue length
+    uint32_t live;              // Live uthreads, main included
+    uint32_t blocked[UTHREAD_STATS_KINDS];
+    uint32_t nlocks;
+    uthread_stats_lock_t locks[UTHREAD_STATS_TOP];      // Most waiters first
+    uint32_t nthreads;
+    uthread_stats_thread_t longest[UTHREAD_STATS_TOP];  // Longest blocked first
+} uthread_stats_page_t;
+
+// Copies a consistent snapshot of a mapped page into *out. Returns false
+// if the page is not a stats page of this version, or if every one of
+// `tries` attempts overlapped a rewrite (or the writer died mid-rewrite).
+static inline bool uthread_stats_read(const uthread_stats_page_t *page,
+                                      uthread_stats_page_t *out, int tries) {
+    while (tries-- > 0) {
+        uint32_t seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        memcpy(out, (const void *)page, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq) {
+            return out->magic == UTHREAD_STATS_MAGIC &&
+                   out->version == UTHREAD_STATS_VERSION;
+        }
+    }
+    return false;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // UTHREAD_STATS_H